@@ -1,371 +1,122 @@
-#include <aio.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <time.h>
-#include <unistd.h>
-#include <ucontext.h>
 
-#define stack_size 1024 * 1024
-#define nbytes 1024
-
-#define yield() ({\
-    int last_ci = sheduler.curr_ci;\
-    sheduler.curr_ci = (sheduler.curr_ci+1) % (sheduler.coros_n+1);\
-    if (!sheduler.curr_ci) { sheduler.curr_ci++; }\
-    if (sheduler.coros[last_ci].active) {\
-        sheduler.coros[last_ci].ttime +=\
-        clock() - sheduler.coros[last_ci].work;\
-    }\
-    if (sheduler.coros[sheduler.curr_ci].active) {\
-        sheduler.coros[sheduler.curr_ci].work = clock();\
-    }\
-    swapcontext(\
-        &sheduler.coros[last_ci].context,\
-        &sheduler.coros[sheduler.curr_ci].context\
-        );\
-})
-
-struct coroutine {
-    ucontext_t context;
-    char* stack;
-    int active;
-    clock_t work, ttime;
-};
-
-struct sheduler {
-    int curr_ci;
-    int coros_n;
-    int working_coros;
-    struct coroutine *coros;
-
-} sheduler;
-
-struct array {
-    int* array;
-    int len;
-};
-
-struct data {
-    int files_n;
-    char** files;
-    struct array* sorted;
-
-} data;
-
-char* async_read(char* filename) {
-    yield();
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1) {
-        printf("Can't open file %s!\n", filename);
-        exit(EXIT_FAILURE);
-    }
-    yield();
-    struct aiocb cb;
-    int bs = nbytes;
-    yield();
-    char* buffer = (char*)malloc(bs * sizeof(char));
-    if (buffer == NULL) {
-        printf("Malloc error!\n");
-        exit(EXIT_FAILURE);
-    }
-    yield();
-    memset(&cb, 0, sizeof(struct aiocb));
-    cb.aio_fildes = fd;
-    cb.aio_offset = 0;
-    cb.aio_nbytes = nbytes;
-    cb.aio_buf = buffer;
-    yield();
-    while (1) {
-        yield();
-        if (aio_read(&cb) == -1) {
-            printf("Unable to create request!\n");
-            free(buffer);
-            close(fd);
-            exit(EXIT_FAILURE);
-        }
-        yield();
-        while (aio_error(&cb) == EINPROGRESS);
-        yield();
-        int nb = aio_return(&cb);
-        if (nb == -1) {
-            printf("Error happened while aio_return!\n");
-            free(buffer);
-            close(fd);
-            exit(EXIT_FAILURE);
-        }
-        yield();
-        cb.aio_offset += nb;
-        yield();
-        if (bs % cb.aio_offset == 0) {
-            yield();
-            bs = cb.aio_offset + nbytes;
-            yield();
-            buffer = (char*)realloc(buffer, bs);
-            yield();
-            if (buffer == NULL) {
-                printf("Realloc error!\n");
-                exit(EXIT_FAILURE);
+#include "sort.h"
+
+void print_counters(struct sorter* s, int inputs_n) { // phases with anything counted
+    static const char* phases[sort_phase_n] = {"read", "parse", "sort", "merge", "write"};
+    long long values[sort_counter_n];
+    char name[32];
+
+    if (sorter_counters(s, -1, sort_merge, values) == -1) {
+        printf("Performance counters are not available.\n\n");
+        return;
+    }
+    printf("%-16s %14s %14s %14s %14s %14s\n", "", "cycles", "instructions", "branch-misses", "LLC-misses", "page-faults");
+    for (int i = 0; i <= inputs_n; i++) {
+        for (int p = 0; p < sort_phase_n; p++) {
+            sorter_counters(s, i < inputs_n ? i : -1, p, values);
+            int counted = 0;
+            for (int k = 0; k < sort_counter_n; k++) { counted |= values[k] > 0; }
+            if (!counted) { continue; }
+            if (i < inputs_n) { snprintf(name, sizeof(name), "Coro %d %s", i + 1, phases[p]); }
+            else { snprintf(name, sizeof(name), "Main %s", phases[p]); }
+            printf("%-16s", name);
+            for (int k = 0; k < sort_counter_n; k++) {
+                if (values[k] == -1) { printf(" %14s", "n/a"); }
+                else { printf(" %14lld", values[k]); }
             }
-        } else {
-            yield();
-            bs = cb.aio_offset + 1;
-            yield();
-            buffer = (char*)realloc(buffer, bs);
-            if (buffer == NULL) {
-                printf("Realloc error!\n");
-                exit(EXIT_FAILURE);
-            }
-            yield();
-            buffer[bs-1] = '\0';
-            yield();
-            close(fd);
-            yield();
-            return buffer;
+            printf("\n");
         }
-        cb.aio_buf = buffer + cb.aio_offset;
-        yield();
     }
+    printf("\n");
 }
 
-void merge(int arr[], int lb, int md, int rb) {
-    int s1 = md - lb + 1;
-    int s2 = rb - md;
-    int larr[s1], rarr[s2];
-
-    for (int i = 0; i < s1; i++) {
-        larr[i] = arr[lb+i];
-    }
-
-    for (int j = 0; j < s2; j++) {
-        rarr[j] = arr[md+j+1];
-    }
-
-    int i = 0, j = 0, k = lb;
-    while (i < s1 && j < s2) {
-        if (larr[i] <= rarr[j]) {
-            arr[k++] = larr[i++];
+int main(int argc, char** argv) { // main [-b] [-m] [-p] [-c CACHE_DIR] files..., "-" is stdin
+    struct sort_options options = {1, NULL, 0};
+    int binary = 0;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-b")) {
+            binary = 1;
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-m")) { // plain malloc, no arena
+            options.use_arena = 0;
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-p")) { // hardware counters per phase
+            options.counters = 1;
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-c") && argc > 2) {
+            options.cache_dir = argv[2];
+            argc -= 2;
+            argv += 2;
         } else {
-            arr[k++] = rarr[j++];
+            break;
         }
     }
-
-    while (i < s1) {
-        arr[k++] = larr[i++];
-    }
-
-    while (j < s2) {
-        arr[k++] = rarr[j++];        
-    }
-    
-    return;
-}
-
-void merge_sort(int arr[], int lb, int rb) {
-    if (lb < rb) {
-        yield();
-        int md = lb + (rb-lb) / 2;
-        yield();
-        merge_sort(arr, lb, md);
-        yield();
-        merge_sort(arr, md+1, rb);
-        yield();
-        merge(arr, lb, md, rb);
-        yield();
-    }
-    yield();
-    return;
-}
-
-void print_array(int arr[], int len) {
-    for (int i = 0; i < len; i++) {
-        printf("%d ", arr[i]);
-    }
-    printf("\n");
-
-    return;
-}
-
-int check_size(FILE *fds) {
-    int count = 0;
-    long n;
-    while (fscanf(fds, "%ld", &n) == 1) {
-        ++count;
-    }
-    return count;
-}
-
-int* convert(char* p, int* l) {
-    FILE *fds = fmemopen(p, strlen(p), "r");
-    *l = check_size(fds);
-    int *result = (int*)malloc(*l * sizeof(int));
-    if (result == NULL) {
-        printf("Malloc error!\n");
-        exit(EXIT_FAILURE);
-    }
-    fseek(fds, 0, SEEK_SET);
-    for (int i = 0; i < *l; ++i) {
-        fscanf(fds, "%d", &result[i]);
-    }
-    return result;
-}
-
-void merge_two_arrays(struct array *a1, struct array *a2) {
-    int *p1 = a1->array, *p2 = a2->array;
-    int *p3 = (int*)malloc((a1->len+a2->len) * sizeof(int)), *head = p3;
-    if (p3 == NULL) {
-        printf("Malloc error!\n");
-        exit(EXIT_FAILURE);
-    }
-
-    while (p1 < a1->array+a1->len && p2 < a2->array+a2->len) {
-        if (*p1 <= *p2) { *p3++ = *p1++; }
-        else { *p3++ = *p2++; }
-    }
-    
-    while (p1 < a1->array + a1->len) { *p3++ = *p1++; }
-    while (p2 < a2->array + a2->len) { *p3++ = *p2++; }
-    free(a1->array);
-    free(a2->array);
-    a1->array = head;
-    a1->len += a2->len;
-}
-
-void merge_arrays(struct array *arrays, size_t arrays_n) {
-    if	(arrays_n < 2) return;
-    merge_arrays(arrays, arrays_n / 2);
-    merge_arrays(arrays + arrays_n/2, arrays_n - arrays_n/2);
-    merge_two_arrays(&arrays[0], &arrays[arrays_n/2]);
-}
-
-void sort() {
-    sheduler.working_coros++;
-    yield();
-    char *res = async_read(data.files[sheduler.curr_ci-1]);
-    yield();
-    struct array result;
-    yield();
-    result.len = 1;
-    yield();
-    result.array = convert(res, &result.len);
-    yield();
-    merge_sort(result.array, 0, result.len-1);
-    yield();
-    data.sorted[sheduler.curr_ci-1].array = result.array;
-    yield();
-    data.sorted[sheduler.curr_ci-1].len = result.len;
-    yield();
-    sheduler.coros[sheduler.curr_ci].active = 0;
-    sheduler.coros[sheduler.curr_ci].ttime += \
-    clock() - sheduler.coros[sheduler.curr_ci].work;
-    sheduler.working_coros--;
-    while (sheduler.working_coros) { yield(); }
-    return;
-}
-
-void* allocate_stack() {
-    void* stack = (void*)malloc(stack_size);
-    if (stack == NULL) {
-        printf("Malloc error!\n");
+    if (argc < 2) {
+        printf("Invalid command line arguments.\n");
         exit(EXIT_FAILURE);
     }
-    stack_t ss;
-    ss.ss_sp = stack;
-    ss.ss_size = stack_size;
-    ss.ss_flags = 0;
-    sigaltstack(&ss, NULL);
-    return stack;
-}
 
-void init() {
-    sheduler.coros = (struct coroutine*)malloc(
-        (sheduler.coros_n+1) * sizeof(struct coroutine));
-    if (sheduler.coros == NULL) {
+    struct sorter* s = sorter_new(&options);
+    if (s == NULL) {
         printf("Malloc error!\n");
         exit(EXIT_FAILURE);
     }
-    for (int i = 1; i <= sheduler.coros_n; i++) {
-        if (getcontext(&sheduler.coros[i].context) == -1) {
-            printf("Can't get context");
+    for (int i = 1; i < argc; i++) {
+        int res = strcmp(argv[i], "-") ? sorter_add_file(s, argv[i]) : sorter_add_fd(s, 0);
+        if (res == -1) {
+            printf("Malloc error!\n");
             exit(EXIT_FAILURE);
         }
-        sheduler.coros[i].ttime = 0;
-        sheduler.coros[i].active = 1;
-        sheduler.coros[i].work = 0;
-        sheduler.coros[i].stack = allocate_stack();
-        sheduler.coros[i].context.uc_stack.ss_sp = sheduler.coros[i].stack;
-        sheduler.coros[i].context.uc_stack.ss_size = stack_size;
-        sheduler.coros[i].context.uc_link = &sheduler.coros[0].context;
-        makecontext(&sheduler.coros[i].context, (void (*)(void))sort, 0);
-
     }
 
-    // sheduler.coros[1].work = clock();
-    return;
-}
+    printf("Starting sorting files...\n");
+    clock_t start = clock();
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
 
-void write_to() {
+    if (sorter_run(s) == -1) {
+        printf("%s\n", sorter_error(s));
+        exit(EXIT_FAILURE);
+    }
     FILE* fd = fopen("result", "w");
-    for (int i = 0; i < data.sorted[0].len; i++) {
-        fprintf(fd, "%d ", data.sorted[0].array[i]);
+    if (fd == NULL) {
+        printf("Can't open file result!\n");
+        exit(EXIT_FAILURE);
     }
-
+    binary ? sorter_write_run(s, fd) : sorter_write_text(s, fd);
     fclose(fd);
-    return;
-}
 
-void duration() {
-    for (int i = 1; i <= sheduler.coros_n; i++) {
-        printf("Coro %d executed in %ld ms.\n", i, sheduler.coros[i].ttime * 100000 / CLOCKS_PER_SEC);
+    for (int i = 0; i < argc - 1; i++) {
+        printf("Coro %d executed in %ld ms.\n", i + 1, sorter_input_time(s, i) * 100000 / CLOCKS_PER_SEC);
     }
     printf("\n");
-}
-
-void free_all() {
-    for (int i = 1; i <= sheduler.coros_n; i++) {
-        free(sheduler.coros[i].stack);
+    if (options.counters) {
+        print_counters(s, argc - 1);
     }
-
-    free(sheduler.coros);
-    free(data.sorted[0].array);
-    free(data.sorted);
-    
-}
-
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        printf("Invalid command line arguments.\n");
-        exit(EXIT_FAILURE);
+    getrusage(RUSAGE_SELF, &usage_end);
+    size_t arena_size;
+    const char* pages = sorter_arena(s, &arena_size);
+    if (pages) {
+        printf("Arena of %zu MB, %s.\n", arena_size >> 20, pages);
     }
-
-    sheduler.curr_ci = 1;
-    sheduler.coros_n = argc - 1;
-    sheduler.working_coros = 0;
-
-    data.files = &argv[1];
-    data.files_n = argc - 1;
-    data.sorted = (struct array*)malloc(data.files_n * sizeof(struct array));
-    if (data.sorted == NULL) {
-        printf("Malloc error!\n");
-        exit(EXIT_FAILURE);
+    printf("Page faults: %ld minor, %ld major.\n", usage_end.ru_minflt - usage_start.ru_minflt,
+           usage_end.ru_majflt - usage_start.ru_majflt);
+    if (options.cache_dir) {
+        printf("Cached runs used for %d of %d files.\n", sorter_cache_hits(s), argc - 1);
     }
-
-    printf("Starting sorting files...\n");
-    clock_t start = clock();
-
-    init();
-    swapcontext(&sheduler.coros[0].context, &sheduler.coros[1].context);
-    merge_arrays(data.sorted, sheduler.coros_n);
-    write_to();
-    duration();
-    free_all();
+    sorter_free(s);
 
     clock_t end = clock();
     printf("Program executed in %ld ms.\n",
             (end-start) * 100000 / CLOCKS_PER_SEC);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,1914 @@
+#include <aio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+#include "sort.h"
+
+#define stack_size 1024 * 1024
+#define nbytes 1024
+#define parallel_threshold (64L * 1024 * 1024) // bytes, bigger files are sorted by threads
+#define max_threads 64
+#define oversampling 32 // samples per bucket when choosing splitters
+#define histogram_range (1 << 20) // files with a smaller min..max range are counted, not stored
+#define run_magic "SRT2" // header of a run file: blocks of delta+varint coded values
+#define block_values 4096 // values per block of a run file
+#define huge_page (2L * 1024 * 1024)
+#define arena_chunk (1024 * 1024) // aio request size when the buffer is preallocated
+#define stream_chunk (64 * 1024) // read() size for pipes and other streams
+#define stream_run 65536 // values of a stream sorted while more are on the way
+#define hash_block (1 << 20) // content hash: FNV-1a of each block, then of the block hashes
+#define fnv_offset 14695981039346656037UL
+
+#define yield(s) ({\
+    struct sheduler* sh_ = &(s)->sheduler;\
+    int last_ci_ = sh_->curr_ci;\
+    sh_->curr_ci = sh_->waiting ? wake_next(sh_) : (sh_->curr_ci+1) % (sh_->coros_n+1);\
+    if (!sh_->curr_ci) { sh_->curr_ci++; }\
+    if (sh_->coros[last_ci_].active) {\
+        sh_->coros[last_ci_].ttime +=\
+        clock() - sh_->coros[last_ci_].work;\
+    }\
+    if (sh_->coros[sh_->curr_ci].active) {\
+        sh_->coros[sh_->curr_ci].work = clock();\
+    }\
+    if ((s)->perf) { perf_switch((s)->perf, sh_->curr_ci); }\
+    swapcontext(\
+        &sh_->coros[last_ci_].context,\
+        &sh_->coros[sh_->curr_ci].context\
+        );\
+})
+
+struct coroutine {
+    ucontext_t context;
+    char* stack;
+    int active;
+    int waiting; // for its stream to become readable
+    clock_t work, ttime;
+};
+
+struct sheduler {
+    int curr_ci;
+    int coros_n;
+    int working_coros;
+    struct coroutine *coros;
+    int epoll; // streams of waiting coroutines, -1 until the first stream
+    int waiting;
+};
+
+struct array {
+    int* array;
+    int len;
+};
+
+struct histogram { // Count of each value in [min, min+size)
+    int min;
+    long size;
+    long* counts; // NULL if the file is kept as an array
+};
+
+struct block_header { // Run file block, payload is n-1 varint deltas from min
+    unsigned int n; // 0 ends the run
+    int min, max;
+    unsigned int bytes; // payload size
+};
+
+struct run_writer { // Streaming encoder
+    FILE* fd;
+    int values[block_values]; // non-decreasing
+    int n;
+    long count;
+};
+
+struct run_reader { // Streaming decoder
+    FILE* fd;
+    int values[block_values];
+    int n, pos;
+    int sorted; // 0 if blocks were not in order
+    int ended; // the n == 0 block was read
+    int broken; // short read or a block that does not decode to its header
+    int last;
+    long count;
+};
+
+struct cache_entry { // One input file in the manifest
+    char* path;
+    long size;
+    long mtime_sec, mtime_nsec;
+    unsigned long hash; // of the file content
+    int hashed; // 0 until hash is known
+    int kept; // manifest entries: an input of this run has the path
+};
+
+struct cache { // Sorted runs of earlier invocations
+    char* dir;
+    struct cache_entry* old; // manifest as loaded
+    int old_n;
+    int* index; // of old by path, open addressing, -1 - free slot
+    size_t index_size; // power of two, at least twice old_n
+    struct cache_entry* fresh; // one per input, saved after the run
+    int hits;
+};
+
+struct region { // Bump allocator inside the arena
+    char* base;
+    size_t size, used;
+};
+
+struct arena { // One mapping for all sort buffers, sized from the inputs
+    char* map;
+    size_t size;
+    int huge; // 2 - MAP_HUGETLB, 1 - MADV_HUGEPAGE, 0 - plain pages
+    size_t page; // text buffers are aligned to it so each can be released on its own
+    struct region text; // file contents, released after parsing
+    struct region ints; // parsed arrays and the merged result
+};
+
+struct perf { // perf_event_open() group, read at every switch and phase change
+    int fds[sort_counter_n]; // fds[0] leads the group
+    int kinds[sort_counter_n]; // enum sort_counter of each fd, some may be missing
+    int n;
+    unsigned long long last[sort_counter_n]; // values of the previous read
+    int running; // coroutine, 0 - outside of them
+    int* phases; // of each coroutine, sort_phase_n - nothing to count
+    long long* counts; // [coroutine][phase][counter]
+};
+
+enum input_kind {
+    input_file,
+    input_fd,
+    input_text,
+    input_ints
+};
+
+struct input { // One coroutine's work
+    enum input_kind kind;
+    const char* path;
+    int fd;
+    const char* text;
+    const int* ints;
+    size_t len;
+};
+
+struct sorter {
+    struct sheduler sheduler;
+    struct input* inputs;
+    int inputs_n, inputs_cap;
+    struct array* sorted; // per input, sorted[0] is the result after merging
+    struct histogram* histograms; // per input, histograms[0] is the result if counted
+    int counted; // 1 - result is histograms[0]
+    struct cache cache;
+    struct arena arena;
+    int use_arena;
+    struct perf* perf; // NULL if counters are off or unavailable
+    int ran;
+    int failed;
+    char error[PATH_MAX + 64];
+};
+
+static void fail(struct sorter* s, const char* format, ...) { // the first error is kept
+    va_list args;
+    if (s->failed++) { return; }
+    va_start(args, format);
+    vsnprintf(s->error, sizeof(s->error), format, args);
+    va_end(args);
+}
+
+static struct perf* perf_open() { // NULL if the kernel gives no counters at all
+    static const unsigned int types[sort_counter_n] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+    };
+    static const unsigned long long configs[sort_counter_n] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_PAGE_FAULTS
+    };
+    struct perf* perf = (struct perf*)calloc(1, sizeof(struct perf));
+    if (perf == NULL) { return NULL; }
+
+    for (int i = 0; i < sort_counter_n; i++) { // VMs often have software counters only
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, perf->n ? perf->fds[0] : -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1) { continue; }
+        perf->fds[perf->n] = fd;
+        perf->kinds[perf->n++] = i;
+    }
+    if (!perf->n) {
+        free(perf);
+        return NULL;
+    }
+    return perf;
+}
+
+static void perf_charge(struct perf* perf) { // counts since the last read go to the running coroutine's phase
+    unsigned long long values[1 + sort_counter_n];
+    if (perf->counts == NULL || read(perf->fds[0], values, sizeof(values)) <= 0) { return; }
+    long long* counts = perf->counts +
+        ((long)perf->running * (sort_phase_n + 1) + perf->phases[perf->running]) * sort_counter_n;
+    for (int i = 0; i < perf->n && (unsigned long long)i < values[0]; i++) {
+        counts[perf->kinds[i]] += values[1+i] - perf->last[i];
+        perf->last[i] = values[1+i];
+    }
+}
+
+static void perf_switch(struct perf* perf, int ci) {
+    perf_charge(perf);
+    perf->running = ci;
+}
+
+static void set_phase(const struct sorter* s, enum sort_phase phase) { // of the running coroutine
+    if (s->perf && s->perf->counts) {
+        perf_charge(s->perf);
+        s->perf->phases[s->perf->running] = phase;
+    }
+}
+
+static void poll_streams(struct sheduler* sh, int timeout) { // wake coroutines whose streams got readable
+    struct epoll_event events[16];
+    int n = epoll_wait(sh->epoll, events, 16, timeout);
+    for (int i = 0; i < n; i++) {
+        struct coroutine* coro = &sh->coros[events[i].data.u32];
+        if (coro->waiting) {
+            coro->waiting = 0;
+            sh->waiting--;
+        }
+    }
+}
+
+static int wake_next(struct sheduler* sh) { // next coroutine that can run, sleeps if all of them wait
+    for (int timeout = 0;; timeout = -1) {
+        for (int ci = sh->curr_ci + 1; ci <= sh->coros_n; ci++) {
+            if (sh->coros[ci].active && !sh->coros[ci].waiting) { return ci; }
+        }
+        poll_streams(sh, timeout); // once per round, not on every switch
+        for (int ci = 1; ci <= sh->curr_ci; ci++) {
+            if (sh->coros[ci].active && !sh->coros[ci].waiting) { return ci; }
+        }
+    }
+}
+
+static void* checked_malloc(size_t size) {
+    void* p = malloc(size);
+    if (p == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static unsigned long hash_bytes(unsigned long hash, const char* p, size_t len) { // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)p[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+static unsigned long add_block(unsigned long hash, const char* p, size_t len) { // one hash_block of content
+    unsigned long block = hash_bytes(fnv_offset, p, len);
+    return hash_bytes(hash, (const char*)&block, sizeof(block));
+}
+
+static unsigned long text_hash(const char* text, size_t len) { // same as file_hash() of a file holding text
+    unsigned long hash = fnv_offset;
+    for (size_t i = 0; i < len; i += hash_block) {
+        hash = add_block(hash, text + i, len - i < hash_block ? len - i : hash_block);
+    }
+    return hash;
+}
+
+static size_t align_up(size_t size, size_t to) {
+    return (size + to - 1) / to * to;
+}
+
+static size_t input_size(struct input* in) { // bytes of text, 0 if unknown
+    struct stat st;
+    switch (in->kind) {
+        case input_file:
+            return stat(in->path, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+        case input_fd:
+            return fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+        case input_text:
+            return in->len;
+        case input_ints:
+            return in->len * 2; // as if "d " each
+    }
+    return 0;
+}
+
+static void init_arena(struct sorter* s) { // no arena if disabled or nothing to map
+    struct arena* arena = &s->arena;
+    size_t text = 0, huge_text = 0, ints = 0;
+
+    for (int i = 0; i < s->inputs_n; i++) {
+        size_t size = input_size(&s->inputs[i]);
+        if (size) {
+            text += align_up(size + 1, getpagesize());
+            huge_text += align_up(size + 1, huge_page); // MADV_DONTNEED takes only whole huge pages there
+            ints += 3 * align_up((size / 2 + 1) * sizeof(int), 64); // array, merge buffer, share of the result
+        }
+    }
+    if (!text) { return; }
+
+    arena->huge = 2;
+    arena->page = huge_page;
+    arena->size = align_up(huge_text + ints, huge_page);
+    arena->map = (char*)mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena->map != MAP_FAILED) {
+        text = huge_text;
+    } else { // not enough reserved huge pages, ask for transparent ones
+        arena->huge = 0;
+        arena->page = getpagesize();
+        arena->size = align_up(text + ints, huge_page);
+        arena->map = (char*)mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena->map == MAP_FAILED) {
+            arena->map = NULL;
+            return;
+        }
+        if (madvise(arena->map, arena->size, MADV_HUGEPAGE) == 0) { arena->huge = 1; }
+    }
+    arena->text.base = arena->map;
+    arena->text.size = text;
+    arena->ints.base = arena->map + text;
+    arena->ints.size = arena->size - text;
+}
+
+static void* region_alloc(struct region* r, size_t size, size_t align) { // NULL if it does not fit
+    size = align_up(size, align);
+    if (r->base == NULL || r->used + size > r->size) { return NULL; }
+    void* p = r->base + r->used;
+    r->used += size;
+    return p;
+}
+
+static void release_text(struct sorter* s, char* p, size_t size) { // give the pages of a parsed input back
+    struct arena* arena = &s->arena;
+    if (arena->map && p >= arena->text.base && p < arena->text.base + arena->text.size) {
+        madvise(p, align_up(size, arena->page), MADV_DONTNEED);
+    } else {
+        free(p);
+    }
+}
+
+static void release_ints(struct sorter* s, int* p) { // arena arrays die with the arena
+    struct arena* arena = &s->arena;
+    if (!arena->map || (char*)p < arena->map || (char*)p >= arena->map + arena->size) {
+        free(p);
+    }
+}
+
+static int* alloc_ints(struct sorter* s, size_t n) {
+    int* p = (int*)region_alloc(&s->arena.ints, (n + 1) * sizeof(int), 64);
+    if (p == NULL) { p = (int*)malloc((n + 1) * sizeof(int)); }
+    if (p == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static char* alloc_text(struct sorter* s, size_t size) {
+    char* p = (char*)region_alloc(&s->arena.text, size + 1, s->arena.page);
+    return p ? p : (char*)checked_malloc(size + 1);
+}
+
+static char* arena_read(struct sorter* s, int fd, size_t size, size_t* len, const char* name) { // whole file into a preallocated buffer
+    struct aiocb cb;
+    char* buffer = (char*)region_alloc(&s->arena.text, size + 1, s->arena.page);
+    if (buffer == NULL) { return NULL; }
+    memset(&cb, 0, sizeof(struct aiocb));
+    cb.aio_fildes = fd;
+    cb.aio_offset = 0;
+    while ((size_t)cb.aio_offset < size) {
+        cb.aio_buf = buffer + cb.aio_offset;
+        cb.aio_nbytes = size - cb.aio_offset < arena_chunk ? size - cb.aio_offset : arena_chunk;
+        if (aio_read(&cb) == -1) {
+            fail(s, "Unable to create request for %s!", name);
+            break;
+        }
+        while (aio_error(&cb) == EINPROGRESS) { yield(s); }
+        int nb = aio_return(&cb);
+        if (nb == -1) {
+            fail(s, "Error happened while aio_return on %s!", name);
+            break;
+        }
+        if (nb == 0) { break; } // file got shorter
+        cb.aio_offset += nb;
+    }
+    buffer[cb.aio_offset] = '\0';
+    *len = cb.aio_offset;
+    return buffer;
+}
+
+static char* async_read(struct sorter* s, int fd, size_t* len, const char* name) { // NULL on errors, fd is not closed
+    yield(s);
+    struct stat st;
+    char* text;
+    if (s->arena.map && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (text = arena_read(s, fd, st.st_size, len, name))) {
+        return text;
+    }
+    struct aiocb cb;
+    int bs = nbytes;
+    yield(s);
+    char* buffer = (char*)checked_malloc(bs * sizeof(char));
+    yield(s);
+    memset(&cb, 0, sizeof(struct aiocb));
+    cb.aio_fildes = fd;
+    cb.aio_offset = 0;
+    cb.aio_nbytes = nbytes;
+    cb.aio_buf = buffer;
+    yield(s);
+    while (1) {
+        yield(s);
+        if (aio_read(&cb) == -1) {
+            fail(s, "Unable to create request for %s!", name);
+            free(buffer);
+            return NULL;
+        }
+        yield(s);
+        while (aio_error(&cb) == EINPROGRESS);
+        yield(s);
+        int nb = aio_return(&cb);
+        if (nb == -1) {
+            fail(s, "Error happened while aio_return on %s!", name);
+            free(buffer);
+            return NULL;
+        }
+        yield(s);
+        cb.aio_offset += nb;
+        yield(s);
+        if (cb.aio_offset && bs % cb.aio_offset == 0) {
+            yield(s);
+            bs = cb.aio_offset + nbytes;
+            yield(s);
+            buffer = (char*)realloc(buffer, bs);
+            yield(s);
+            if (buffer == NULL) {
+                printf("Realloc error!\n");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            yield(s);
+            bs = cb.aio_offset + 1;
+            yield(s);
+            buffer = (char*)realloc(buffer, bs);
+            if (buffer == NULL) {
+                printf("Realloc error!\n");
+                exit(EXIT_FAILURE);
+            }
+            yield(s);
+            buffer[bs-1] = '\0';
+            *len = bs-1;
+            yield(s);
+            return buffer;
+        }
+        cb.aio_buf = buffer + cb.aio_offset;
+        yield(s);
+    }
+}
+
+static void merge(int arr[], int tmp[], int lb, int md, int rb) { // tmp has room for arr, not the coroutine stack
+    int s1 = md - lb + 1;
+    int s2 = rb - md;
+    int *larr = tmp + lb, *rarr = tmp + md + 1;
+
+    for (int i = 0; i < s1; i++) {
+        larr[i] = arr[lb+i];
+    }
+
+    for (int j = 0; j < s2; j++) {
+        rarr[j] = arr[md+j+1];
+    }
+
+    int i = 0, j = 0, k = lb;
+    while (i < s1 && j < s2) {
+        if (larr[i] <= rarr[j]) {
+            arr[k++] = larr[i++];
+        } else {
+            arr[k++] = rarr[j++];
+        }
+    }
+
+    while (i < s1) {
+        arr[k++] = larr[i++];
+    }
+
+    while (j < s2) {
+        arr[k++] = rarr[j++];
+    }
+
+    return;
+}
+
+static void merge_sort(struct sorter* s, int arr[], int tmp[], int lb, int rb) {
+    if (lb < rb) {
+        yield(s);
+        int md = lb + (rb-lb) / 2;
+        yield(s);
+        merge_sort(s, arr, tmp, lb, md);
+        yield(s);
+        merge_sort(s, arr, tmp, md+1, rb);
+        yield(s);
+        merge(arr, tmp, lb, md, rb);
+        yield(s);
+    }
+    yield(s);
+    return;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static const char* next_number(const char* p, long* value) { // NULL at the end, "12ab" is 12, "ab12" is skipped
+    while (1) {
+        while (is_space(*p)) { p++; }
+        if (*p == '\0') { return NULL; }
+        int negative = *p == '-';
+        const char* q = p + negative;
+        if (*q >= '0' && *q <= '9') {
+            long n = 0;
+            while (*q >= '0' && *q <= '9') { n = n * 10 + (*q++ - '0'); }
+            while (*q != '\0' && !is_space(*q)) { q++; }
+            *value = negative ? -n : n;
+            return q;
+        }
+        while (*p != '\0' && !is_space(*p)) { p++; } // not a number, skip the word
+    }
+}
+
+static int* convert(struct sorter* s, char* p, int* l) {
+    const char* q = p;
+    long value;
+    int count = 0;
+    while ((q = next_number(q, &value)) != NULL) {
+        ++count;
+    }
+    *l = count;
+    int *result = alloc_ints(s, *l);
+    q = p;
+    for (int i = 0; i < *l; ++i) {
+        q = next_number(q, &value);
+        result[i] = (int)value;
+    }
+    return result;
+}
+
+static void merge_two_arrays(struct sorter* s, struct array *a1, struct array *a2) {
+    int *p1 = a1->array, *p2 = a2->array;
+    int *p3 = (int*)checked_malloc((a1->len+a2->len+1) * sizeof(int)), *head = p3;
+
+    while (p1 < a1->array+a1->len && p2 < a2->array+a2->len) {
+        if (*p1 <= *p2) { *p3++ = *p1++; }
+        else { *p3++ = *p2++; }
+    }
+
+    while (p1 < a1->array + a1->len) { *p3++ = *p1++; }
+    while (p2 < a2->array + a2->len) { *p3++ = *p2++; }
+    release_ints(s, a1->array);
+    release_ints(s, a2->array);
+    a1->array = head;
+    a1->len += a2->len;
+}
+
+static void merge_arrays(struct sorter* s, struct array *arrays, size_t arrays_n) {
+    if	(arrays_n < 2) return;
+    merge_arrays(s, arrays, arrays_n / 2);
+    merge_arrays(s, arrays + arrays_n/2, arrays_n - arrays_n/2);
+    merge_two_arrays(s, &arrays[0], &arrays[arrays_n/2]);
+}
+
+static void sift_down(int heap[], int n, int i, struct array *arrays, int pos[]) { // heap of array ids by head value
+    while (2 * i + 1 < n) {
+        int c = 2 * i + 1;
+        if (c + 1 < n && arrays[heap[c+1]].array[pos[heap[c+1]]] < arrays[heap[c]].array[pos[heap[c]]]) { c++; }
+        if (arrays[heap[i]].array[pos[heap[i]]] <= arrays[heap[c]].array[pos[heap[c]]]) { break; }
+        int tmp = heap[i]; heap[i] = heap[c]; heap[c] = tmp;
+        i = c;
+    }
+}
+
+static void merge_all(struct sorter* s, struct array *arrays, int arrays_n) { // k-way merge into one arena array
+    long total = 0;
+    int n = 0;
+    int *heap = (int*)checked_malloc(arrays_n * sizeof(int));
+    int *pos = (int*)calloc(arrays_n, sizeof(int));
+    if (pos == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < arrays_n; i++) {
+        total += arrays[i].len;
+        if (arrays[i].len) { heap[n++] = i; }
+    }
+    int *out = alloc_ints(s, total), *p = out;
+    for (int i = n / 2 - 1; i >= 0; i--) { sift_down(heap, n, i, arrays, pos); }
+    while (n) {
+        int a = heap[0];
+        *p++ = arrays[a].array[pos[a]++];
+        if (pos[a] == arrays[a].len) { heap[0] = heap[--n]; }
+        sift_down(heap, n, 0, arrays, pos);
+    }
+    for (int i = 0; i < arrays_n; i++) { release_ints(s, arrays[i].array); }
+    arrays[0].array = out;
+    arrays[0].len = (int)total;
+    free(heap);
+    free(pos);
+}
+
+struct segment { // Part of a big file handled by one thread
+    struct parallel* job;
+    int id;
+    int* numbers;
+    long len, cap;
+    long* counts; // numbers of this segment in each bucket
+};
+
+struct parallel { // Sample sort of one big file
+    int fd;
+    char* text;
+    long size;
+    int threads;
+    struct segment* segments;
+    int* splitters; // threads-1 bounds between buckets
+    long* bucket_start; // threads+1 offsets in result
+    int* result;
+    pthread_barrier_t barrier;
+    int finished;
+    int failed; // a read error, the result is garbage
+    unsigned long* hashes; // of each hash_block, NULL if not wanted
+};
+
+static void sort_ints(int arr[], long len, int tmp[]) { // bottom-up merge sort, never yields
+    for (long width = 1; width < len; width *= 2) {
+        for (long lb = 0; lb < len; lb += 2 * width) {
+            long md = lb + width < len ? lb + width : len;
+            long rb = lb + 2 * width < len ? lb + 2 * width : len;
+            long i = lb, j = md, k = lb;
+            while (i < md && j < rb) {
+                if (arr[i] <= arr[j]) { tmp[k++] = arr[i++]; }
+                else { tmp[k++] = arr[j++]; }
+            }
+            while (i < md) { tmp[k++] = arr[i++]; }
+            while (j < rb) { tmp[k++] = arr[j++]; }
+        }
+        memcpy(arr, tmp, len * sizeof(int));
+    }
+}
+
+static void parse_segment(struct segment* seg, long from, long to) { // numbers starting in [from, to)
+    char* text = seg->job->text;
+    long size = seg->job->size;
+    long i = from;
+
+    if (i > 0) { // a number crossing from belongs to the previous segment
+        while (i < size && !is_space(text[i-1])) { i++; }
+    }
+    seg->len = 0;
+    seg->cap = (to - from) / 4 + 16;
+    seg->numbers = (int*)checked_malloc(seg->cap * sizeof(int));
+    while (i < to) {
+        while (i < to && is_space(text[i])) { i++; }
+        if (i >= to) { break; }
+        int negative = text[i] == '-';
+        long j = i + negative;
+        long value = 0;
+        if (j >= size || text[j] < '0' || text[j] > '9') { // not a number, skip the word
+            while (i < size && !is_space(text[i])) { i++; }
+            continue;
+        }
+        while (j < size && text[j] >= '0' && text[j] <= '9') {
+            value = value * 10 + (text[j++] - '0');
+        }
+        while (j < size && !is_space(text[j])) { j++; }
+        if (seg->len == seg->cap) {
+            seg->cap *= 2;
+            seg->numbers = (int*)realloc(seg->numbers, seg->cap * sizeof(int));
+            if (seg->numbers == NULL) {
+                printf("Realloc error!\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        seg->numbers[seg->len++] = (int)(negative ? -value : value);
+        i = j;
+    }
+}
+
+static void choose_splitters(struct parallel* job) {
+    long total = 0, n = (long)job->threads * oversampling;
+    int* samples = (int*)checked_malloc(n * sizeof(int));
+    int* tmp = (int*)checked_malloc(n * sizeof(int));
+
+    for (int i = 0; i < job->threads; i++) {
+        total += job->segments[i].len;
+    }
+    for (long k = 0; k < n; k++) { // evenly spaced over the whole input
+        long index = total ? (long)((double)k * total / n) : 0;
+        int s = 0;
+        while (s < job->threads - 1 && index >= job->segments[s].len) {
+            index -= job->segments[s++].len;
+        }
+        samples[k] = index < job->segments[s].len ? job->segments[s].numbers[index] : 0;
+    }
+    sort_ints(samples, n, tmp);
+    for (int b = 0; b < job->threads - 1; b++) {
+        job->splitters[b] = samples[(b + 1) * oversampling];
+    }
+    free(samples);
+    free(tmp);
+}
+
+static int find_bucket(struct parallel* job, int value) { // first splitter greater than value
+    int lb = 0, rb = job->threads - 1;
+    while (lb < rb) {
+        int md = (lb + rb) / 2;
+        if (job->splitters[md] > value) { rb = md; }
+        else { lb = md + 1; }
+    }
+    return lb;
+}
+
+static void* parallel_worker(void* arg) {
+    struct segment* seg = (struct segment*)arg;
+    struct parallel* job = seg->job;
+    long from = job->size * seg->id / job->threads;
+    long to = job->size * (seg->id + 1) / job->threads;
+
+    for (long done = from; done < to;) { // read own part of the file
+        ssize_t nb = pread(job->fd, job->text + done, to - done, done);
+        if (nb <= 0) {
+            memset(job->text + done, ' ', to - done);
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        done += nb;
+    }
+    pthread_barrier_wait(&job->barrier);
+
+    if (job->hashes) { // blocks starting in own part, the rest of the text is read by now
+        for (long b = (from + hash_block - 1) / hash_block; b * hash_block < to; b++) {
+            long end = (b + 1) * hash_block < job->size ? (b + 1) * hash_block : job->size;
+            job->hashes[b] = hash_bytes(fnv_offset, job->text + b * hash_block, end - b * hash_block);
+        }
+    }
+    parse_segment(seg, from, to);
+    pthread_barrier_wait(&job->barrier);
+
+    if (seg->id == 0) {
+        choose_splitters(job);
+    }
+    pthread_barrier_wait(&job->barrier);
+
+    seg->counts = (long*)calloc(job->threads, sizeof(long));
+    if (seg->counts == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < seg->len; i++) {
+        seg->counts[find_bucket(job, seg->numbers[i])]++;
+    }
+    pthread_barrier_wait(&job->barrier);
+
+    if (seg->id == 0) {
+        job->bucket_start[0] = 0;
+        for (int b = 0; b < job->threads; b++) {
+            job->bucket_start[b+1] = job->bucket_start[b];
+            for (int i = 0; i < job->threads; i++) {
+                job->bucket_start[b+1] += job->segments[i].counts[b];
+            }
+        }
+        job->result = (int*)checked_malloc((job->bucket_start[job->threads] + 1) * sizeof(int));
+    }
+    pthread_barrier_wait(&job->barrier);
+
+    long* offsets = (long*)checked_malloc(job->threads * sizeof(long));
+    for (int b = 0; b < job->threads; b++) { // scatter into buckets
+        offsets[b] = job->bucket_start[b];
+        for (int i = 0; i < seg->id; i++) {
+            offsets[b] += job->segments[i].counts[b];
+        }
+    }
+    for (long i = 0; i < seg->len; i++) {
+        job->result[offsets[find_bucket(job, seg->numbers[i])]++] = seg->numbers[i];
+    }
+    free(offsets);
+    pthread_barrier_wait(&job->barrier);
+
+    free(seg->numbers); // thread id is also the bucket it sorts
+    long lb = job->bucket_start[seg->id], len = job->bucket_start[seg->id+1] - lb;
+    int* tmp = (int*)checked_malloc((len + 1) * sizeof(int));
+    sort_ints(job->result + lb, len, tmp);
+    free(tmp);
+
+    __atomic_add_fetch(&job->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int* parallel_sort(struct sorter* s, int fd, long size, int* len, unsigned long* hash, const char* name) {
+    // split, parse and sample sort on threads, hash the text too if hash is not NULL
+    struct parallel job;
+    pthread_t ids[max_threads];
+    long blocks = (size + hash_block - 1) / hash_block;
+
+    job.fd = fd;
+    job.size = size;
+    job.text = (char*)checked_malloc(size + 1);
+    job.text[size] = '\0';
+    job.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (job.threads < 1) { job.threads = 1; }
+    if (job.threads > max_threads) { job.threads = max_threads; }
+    job.segments = (struct segment*)checked_malloc(job.threads * sizeof(struct segment));
+    job.splitters = (int*)checked_malloc(job.threads * sizeof(int));
+    job.bucket_start = (long*)checked_malloc((job.threads + 1) * sizeof(long));
+    job.finished = 0;
+    job.failed = 0;
+    job.hashes = hash ? (unsigned long*)checked_malloc((blocks + 1) * sizeof(unsigned long)) : NULL;
+    pthread_barrier_init(&job.barrier, NULL, job.threads);
+
+    for (int i = 0; i < job.threads; i++) {
+        job.segments[i].job = &job;
+        job.segments[i].id = i;
+        if (pthread_create(&ids[i], NULL, parallel_worker, &job.segments[i])) {
+            printf("Can't create thread!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (__atomic_load_n(&job.finished, __ATOMIC_ACQUIRE) < job.threads && s->sheduler.working_coros > 1) {
+        yield(s); // other inputs go on meanwhile
+    }
+    for (int i = 0; i < job.threads; i++) {
+        pthread_join(ids[i], NULL);
+        free(job.segments[i].counts);
+    }
+
+    *len = (int)job.bucket_start[job.threads];
+    if (job.failed) {
+        fail(s, "Error happened while reading %s!", name);
+    }
+    if (job.bucket_start[job.threads] > INT_MAX) { // lengths are ints
+        fail(s, "Too many numbers in %s!", name);
+        free(job.result);
+        job.result = NULL;
+        *len = 0;
+    }
+    if (hash) {
+        *hash = fnv_offset;
+        for (long b = 0; b < blocks; b++) {
+            *hash = hash_bytes(*hash, (const char*)&job.hashes[b], sizeof(unsigned long));
+        }
+        free(job.hashes);
+    }
+    pthread_barrier_destroy(&job.barrier);
+    free(job.text);
+    free(job.segments);
+    free(job.splitters);
+    free(job.bucket_start);
+    return job.result;
+}
+
+static int fit_histogram(struct histogram* h, long value) { // grow h to hold value, 0 if the range gets too big
+    long lo = h->counts ? h->min : value;
+    long hi = h->counts ? h->min + h->size - 1 : value;
+    if (h->counts && value >= lo && value <= hi) { return 1; }
+    if (value < lo) { lo = value; }
+    if (value > hi) { hi = value; }
+    long size = hi - lo + 1;
+    if (size > histogram_range) { return 0; }
+    if (size < 2 * h->size) { // leave room in the direction of growth
+        size = 2 * h->size < histogram_range ? 2 * h->size : histogram_range;
+    }
+    if (h->counts && value < h->min) {
+        lo = hi - size + 1 < INT_MIN ? INT_MIN : hi - size + 1;
+    } else {
+        lo = lo + size - 1 > INT_MAX ? INT_MAX - size + 1 : lo;
+    }
+
+    long* counts = (long*)calloc(size, sizeof(long));
+    if (counts == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (h->counts) {
+        memcpy(counts + (h->min - lo), h->counts, h->size * sizeof(long));
+        free(h->counts);
+    }
+    h->counts = counts;
+    h->min = (int)lo;
+    h->size = size;
+    return 1;
+}
+
+static int count_values(struct sorter* s, char* p, struct histogram* h) { // parse p into a histogram, 0 if values are too spread
+    const char* q = p;
+    long value, n = 0;
+    while ((q = next_number(q, &value)) != NULL) {
+        if (value < INT_MIN || value > INT_MAX || !fit_histogram(h, value)) {
+            free(h->counts);
+            h->counts = NULL;
+            h->size = 0;
+            return 0;
+        }
+        h->counts[value - h->min]++;
+        if (++n % 65536 == 0) { yield(s); }
+    }
+    if (h->counts == NULL) { // no numbers: counted, with an empty range
+        h->counts = (long*)checked_malloc(sizeof(long));
+        h->min = 0;
+        h->size = 0;
+    }
+    return 1;
+}
+
+static void add_histogram(struct histogram* to, struct histogram* from) {
+    for (long i = 0; i < from->size; i++) {
+        if (from->counts[i]) {
+            to->counts[from->min + i - to->min] += from->counts[i];
+        }
+    }
+    free(from->counts);
+    from->counts = NULL;
+}
+
+static long histogram_len(const struct histogram* h) {
+    long len = 0;
+    for (long i = 0; i < h->size; i++) { len += h->counts[i]; }
+    return len;
+}
+
+static void expand_histogram(struct histogram* h, struct array* a) { // back to a sorted array
+    long len = histogram_len(h);
+    a->array = (int*)checked_malloc((len + 1) * sizeof(int));
+    a->len = (int)len;
+    int* p = a->array;
+    for (long i = 0; i < h->size; i++) {
+        for (long k = 0; k < h->counts[i]; k++) { *p++ = (int)(h->min + i); }
+    }
+    free(h->counts);
+    h->counts = NULL;
+}
+
+static int combine_histograms(struct sorter* s) { // sum all inputs into histograms[0], 0 if not all were counted
+    long lo = LONG_MAX, hi = LONG_MIN;
+    for (int i = 0; i < s->inputs_n; i++) {
+        struct histogram* h = &s->histograms[i];
+        if (h->counts == NULL) { return 0; }
+        if (h->size == 0) { continue; } // empty input
+        if (h->min < lo) { lo = h->min; }
+        if (h->min + h->size - 1 > hi) { hi = h->min + h->size - 1; }
+    }
+    if (lo > hi) { lo = hi = 0; } // all inputs are empty
+    if (hi - lo + 1 > histogram_range) { return 0; }
+
+    struct histogram total = {(int)lo, hi - lo + 1, NULL};
+    total.counts = (long*)calloc(total.size, sizeof(long));
+    if (total.counts == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < s->inputs_n; i++) {
+        add_histogram(&total, &s->histograms[i]);
+    }
+    s->histograms[0] = total;
+    return 1;
+}
+
+static int is_run(const char* filename) { // file starts with run_magic
+    char magic[4];
+    FILE* fd = fopen(filename, "r");
+    if (fd == NULL) { return 0; }
+    int res = fread(magic, 1, 4, fd) == 4 && !memcmp(magic, run_magic, 4);
+    fclose(fd);
+    return res;
+}
+
+static void run_writer_open(struct run_writer* w, FILE* fd) {
+    w->fd = fd;
+    w->n = 0;
+    w->count = 0;
+    fwrite(run_magic, 1, 4, fd);
+}
+
+static void flush_block(struct run_writer* w) {
+    unsigned char payload[block_values * 5];
+    struct block_header header;
+    unsigned int bytes = 0;
+
+    for (int i = 1; i < w->n; i++) {
+        unsigned int delta = (unsigned int)w->values[i] - (unsigned int)w->values[i-1];
+        while (delta >= 0x80) {
+            payload[bytes++] = (unsigned char)(delta | 0x80);
+            delta >>= 7;
+        }
+        payload[bytes++] = (unsigned char)delta;
+    }
+    header.n = w->n;
+    header.min = w->values[0];
+    header.max = w->values[w->n-1];
+    header.bytes = bytes;
+    fwrite(&header, sizeof(header), 1, w->fd);
+    fwrite(payload, 1, bytes, w->fd);
+    w->count += w->n;
+    w->n = 0;
+}
+
+static void run_write(struct run_writer* w, int value) { // a smaller value starts a new block
+    if (w->n == block_values || (w->n && value < w->values[w->n-1])) {
+        flush_block(w);
+    }
+    w->values[w->n++] = value;
+}
+
+static void run_writer_close(struct run_writer* w) { // the FILE stays open
+    struct block_header end = {0, 0, 0, 0};
+    if (w->n) { flush_block(w); }
+    fwrite(&end, sizeof(end), 1, w->fd);
+}
+
+static int run_reader_open(struct run_reader* r, FILE* fd) { // 0 if fd is not a run
+    char magic[4];
+    r->fd = fd;
+    r->n = r->pos = 0;
+    r->sorted = 1;
+    r->ended = r->broken = 0;
+    r->count = 0;
+    r->last = 0;
+    return fread(magic, 1, 4, fd) == 4 && !memcmp(magic, run_magic, 4);
+}
+
+static int read_block(struct run_reader* r) { // 0 at the end or on a broken block, r->ended tells which
+    unsigned char payload[block_values * 5];
+    struct block_header header;
+
+    if (fread(&header, sizeof(header), 1, r->fd) == 1 && header.n == 0) {
+        r->ended = 1;
+        return 0;
+    }
+    if (feof(r->fd) || ferror(r->fd) || header.n > block_values || header.bytes > sizeof(payload) ||
+        fread(payload, 1, header.bytes, r->fd) != header.bytes) {
+        r->broken = 1;
+        return 0;
+    }
+    if (r->count && header.min < r->last) { r->sorted = 0; }
+    r->values[0] = header.min;
+    unsigned int bytes = 0;
+    for (unsigned int i = 1; i < header.n; i++) {
+        unsigned int delta = 0;
+        int complete = 0;
+        for (int shift = 0; bytes < header.bytes && shift < 35; shift += 7) {
+            unsigned char b = payload[bytes++];
+            delta |= (unsigned int)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                complete = 1;
+                break;
+            }
+        }
+        if (!complete) {
+            r->broken = 1;
+            return 0;
+        }
+        r->values[i] = (int)((unsigned int)r->values[i-1] + delta);
+    }
+    if (bytes != header.bytes || r->values[header.n-1] != header.max) {
+        r->broken = 1;
+        return 0;
+    }
+    r->n = header.n;
+    r->pos = 0;
+    r->last = r->values[r->n-1];
+    r->count += r->n;
+    return 1;
+}
+
+static int run_read(struct run_reader* r, int* value) { // 0 at the end of the run or on a broken block
+    if (r->pos == r->n && !read_block(r)) { return 0; }
+    *value = r->values[r->pos++];
+    return 1;
+}
+
+static int read_run_file(struct sorter* s, const char* filename, struct array* result) { // whole run into an array, 0 if broken
+    struct run_reader r;
+    long cap = block_values;
+    int value;
+    FILE* fd = fopen(filename, "r");
+
+    if (fd == NULL) { return 0; }
+    if (!run_reader_open(&r, fd)) {
+        fclose(fd);
+        return 0;
+    }
+    result->array = (int*)checked_malloc(cap * sizeof(int));
+    result->len = 0;
+    while (run_read(&r, &value)) {
+        if (result->len == cap) {
+            cap *= 2;
+            result->array = (int*)realloc(result->array, cap * sizeof(int));
+            if (result->array == NULL) {
+                printf("Realloc error!\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        result->array[result->len++] = value;
+        if (r.pos == r.n) { yield(s); }
+    }
+    fclose(fd);
+    if (!r.ended || r.broken) { // truncated or corrupt, not a complete run
+        free(result->array);
+        result->array = NULL;
+        result->len = 0;
+        return 0;
+    }
+    if (!r.sorted) {
+        int* tmp = (int*)checked_malloc((result->len + 1) * sizeof(int));
+        sort_ints(result->array, result->len, tmp);
+        free(tmp);
+    }
+    return 1;
+}
+
+static int file_hash(struct sorter* s, int fd, unsigned long* hash) { // 0 on read errors, fd is rewound
+    char* buffer = (char*)checked_malloc(hash_block);
+    ssize_t nb = 1;
+    *hash = fnv_offset;
+    while (nb > 0) {
+        size_t len = 0;
+        while (len < hash_block && (nb = read(fd, buffer + len, hash_block - len)) > 0) { len += nb; }
+        if (len) { *hash = add_block(*hash, buffer, len); }
+        yield(s);
+    }
+    free(buffer);
+    return nb == 0 && lseek(fd, 0, SEEK_SET) == 0;
+}
+
+static unsigned long path_hash(const char* path) {
+    return hash_bytes(fnv_offset, path, strlen(path));
+}
+
+static void run_name(struct sorter* s, char* name, size_t size, const char* path) { // cache file of a path
+    snprintf(name, size, "%s/%016lx.run", s->cache.dir, path_hash(path));
+}
+
+static struct cache_entry* find_old(const struct cache* cache, const char* path) { // first manifest entry of path, NULL if none
+    if (!cache->index_size) { return NULL; }
+    for (size_t i = path_hash(path) & (cache->index_size - 1); cache->index[i] != -1; i = (i + 1) & (cache->index_size - 1)) {
+        struct cache_entry* e = &cache->old[cache->index[i]];
+        if (!strcmp(e->path, path)) { return e; }
+    }
+    return NULL;
+}
+
+static void index_manifest(struct cache* cache) { // one lookup per input instead of a scan of the manifest
+    cache->index_size = 16;
+    while (cache->index_size < 2 * (size_t)cache->old_n) { cache->index_size *= 2; }
+    cache->index = (int*)checked_malloc(cache->index_size * sizeof(int));
+    memset(cache->index, -1, cache->index_size * sizeof(int));
+    for (int i = 0; i < cache->old_n; i++) {
+        if (find_old(cache, cache->old[i].path)) { continue; } // the same file given twice
+        size_t k = path_hash(cache->old[i].path) & (cache->index_size - 1);
+        while (cache->index[k] != -1) { k = (k + 1) & (cache->index_size - 1); }
+        cache->index[k] = i;
+    }
+}
+
+static int load_manifest(struct sorter* s) { // 0 if the cache directory can't be used
+    struct cache* cache = &s->cache;
+    char name[PATH_MAX], path[PATH_MAX];
+    struct cache_entry e;
+    int cap = 0;
+
+    if (mkdir(cache->dir, 0777) == -1 && errno != EEXIST) {
+        return 0;
+    }
+    snprintf(name, sizeof(name), "%s/manifest", cache->dir);
+    FILE* fd = fopen(name, "r");
+    if (fd == NULL) { return 1; }
+    while (fscanf(fd, "%ld %ld %ld %lx %4095[^\n]", &e.size, &e.mtime_sec, &e.mtime_nsec, &e.hash, path) == 5) {
+        if (cache->old_n == cap) {
+            cap = cap ? cap * 2 : 16;
+            cache->old = (struct cache_entry*)realloc(cache->old, cap * sizeof(struct cache_entry));
+            if (cache->old == NULL) {
+                printf("Realloc error!\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        e.path = strdup(path);
+        e.hashed = 1;
+        e.kept = 0;
+        cache->old[cache->old_n++] = e;
+    }
+    fclose(fd);
+    index_manifest(cache);
+    return 1;
+}
+
+static void save_manifest(struct sorter* s) { // files of this run only, runs of other files are removed
+    struct cache* cache = &s->cache;
+    char name[PATH_MAX], tmp[PATH_MAX];
+
+    snprintf(name, sizeof(name), "%s/manifest", cache->dir);
+    snprintf(tmp, sizeof(tmp), "%s/manifest.tmp", cache->dir);
+    FILE* fd = fopen(tmp, "w");
+    if (fd == NULL) {
+        fail(s, "Can't write cache file %s!", tmp);
+        return;
+    }
+    for (int i = 0; i < s->inputs_n; i++) {
+        struct cache_entry* e = &cache->fresh[i];
+        if (e->path && e->hashed) {
+            fprintf(fd, "%ld %ld %ld %016lx %s\n", e->size, e->mtime_sec, e->mtime_nsec, e->hash, e->path);
+            struct cache_entry* old = find_old(cache, e->path);
+            if (old) { old->kept = 1; }
+        }
+    }
+    if (fclose(fd) == 0) {
+        rename(tmp, name);
+    }
+
+    for (int i = 0; i < cache->old_n; i++) {
+        if (!find_old(cache, cache->old[i].path)->kept) { // duplicates share the first entry
+            run_name(s, name, sizeof(name), cache->old[i].path);
+            unlink(name);
+        }
+    }
+}
+
+static int load_run(struct sorter* s, struct cache_entry* e, struct array* result) { // 0 if the run is missing or broken
+    char name[PATH_MAX];
+
+    run_name(s, name, sizeof(name), e->path);
+    return read_run_file(s, name, result);
+}
+
+static void write_values(struct run_writer* w, const struct array* a, const struct histogram* h) { // array or counts
+    if (h && h->counts) {
+        for (long i = 0; i < h->size; i++) {
+            for (long k = 0; k < h->counts[i]; k++) { run_write(w, (int)(h->min + i)); }
+        }
+    } else {
+        for (int i = 0; i < a->len; i++) { run_write(w, a->array[i]); }
+    }
+}
+
+static void save_run(struct sorter* s, struct cache_entry* e, struct array* result, struct histogram* h) {
+    struct run_writer w;
+    char name[PATH_MAX];
+
+    run_name(s, name, sizeof(name), e->path);
+    FILE* fd = fopen(name, "w");
+    if (fd == NULL) {
+        fail(s, "Can't write cache file %s!", name);
+        return;
+    }
+    run_writer_open(&w, fd);
+    write_values(&w, result, h);
+    run_writer_close(&w);
+    if (fclose(fd)) {
+        fail(s, "Can't write cache file %s!", name);
+        unlink(name);
+    }
+}
+
+static int cached_sort(struct sorter* s, int id, struct stat* st, struct array* result,
+                       struct cache_entry** touched) { // 1 if the file did not change
+    // *touched is the entry of a file with a new mtime, its content is checked once it is read
+    struct cache* cache = &s->cache;
+    const char* file = s->inputs[id].path;
+    char path[PATH_MAX];
+    struct cache_entry* e = &cache->fresh[id];
+
+    if (realpath(file, path) == NULL) {
+        strncpy(path, file, PATH_MAX - 1);
+        path[PATH_MAX-1] = '\0';
+    }
+    e->path = strdup(path);
+    e->size = st->st_size;
+    e->mtime_sec = st->st_mtim.tv_sec;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->hashed = 0;
+    struct cache_entry* old = find_old(cache, e->path);
+    if (!old || old->size != e->size) { return 0; }
+    if (old->mtime_sec != e->mtime_sec || old->mtime_nsec != e->mtime_nsec) {
+        *touched = old; // maybe not changed
+        return 0;
+    }
+    e->hash = old->hash;
+    if (!load_run(s, e, result)) { return 0; }
+    e->hashed = 1;
+    cache->hits++;
+    return 1;
+}
+
+static int reuse_run(struct sorter* s, struct cache_entry* e, const struct cache_entry* touched,
+                     struct array* result) { // 1 if a touched file's content did not change
+    if (!touched || !e->hashed || e->hash != touched->hash || !load_run(s, e, result)) { return 0; }
+    s->cache.hits++;
+    return 1;
+}
+
+static void sort_text(struct sorter* s, int id, char* res, struct array* result) { // count or parse and merge sort
+    set_phase(s, sort_parse);
+    if (count_values(s, res, &s->histograms[id])) {
+        result->array = NULL; // small range of values: counts only
+        result->len = 0;
+        release_text(s, res, strlen(res) + 1);
+        return;
+    }
+    result->len = 1;
+    yield(s);
+    result->array = convert(s, res, &result->len);
+    release_text(s, res, strlen(res) + 1);
+    yield(s);
+    set_phase(s, sort_sort);
+    int* tmp = alloc_ints(s, result->len);
+    merge_sort(s, result->array, tmp, 0, result->len-1);
+    release_ints(s, tmp);
+}
+
+struct stream { // Numbers of a pipe parsed as they arrive
+    int* numbers;
+    long len, cap;
+    long sorted; // numbers[0, sorted) are sorted runs of stream_run values
+    int state; // 0 - between words, 1 - in a number, 2 - in some other word
+    int negative, digits;
+    long value;
+};
+
+static void stream_push(struct stream* st) {
+    if (st->len == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : stream_run;
+        st->numbers = (int*)realloc(st->numbers, st->cap * sizeof(int));
+        if (st->numbers == NULL) {
+            printf("Realloc error!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    st->numbers[st->len++] = (int)(st->negative ? -st->value : st->value);
+}
+
+static void parse_stream(struct stream* st, const char* p, long n) { // a number may continue in the next chunk
+    for (long i = 0; i < n; i++) {
+        char c = p[i];
+        if (is_space(c)) {
+            if (st->state == 1 && st->digits) { stream_push(st); }
+            st->state = 0;
+        } else if (c >= '0' && c <= '9' && st->state != 2) {
+            if (st->state == 0) {
+                st->state = 1;
+                st->negative = 0;
+                st->value = 0;
+                st->digits = 0;
+            }
+            st->value = st->value * 10 + (c - '0');
+            st->digits++;
+        } else if (c == '-' && st->state == 0) {
+            st->state = 1;
+            st->negative = 1;
+            st->value = 0;
+            st->digits = 0;
+        } else { // like parse_segment(): "12ab" is 12, "ab12" is skipped
+            if (st->state == 1 && st->digits) { stream_push(st); }
+            st->state = 2;
+        }
+    }
+}
+
+static void sort_stream(struct sorter* s, int fd, const char* name, struct array* result) { // pipes, FIFOs, sockets, terminals
+    struct sheduler* sh = &s->sheduler;
+    struct stream st;
+    struct epoll_event event;
+    char* buffer = (char*)checked_malloc(stream_chunk);
+    int* tmp = (int*)checked_malloc(stream_run * sizeof(int));
+    int flags = fcntl(fd, F_GETFL);
+    int polled = 0;
+
+    memset(&st, 0, sizeof(st));
+    if (flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0) {
+        if (sh->epoll == -1) { sh->epoll = epoll_create1(EPOLL_CLOEXEC); }
+        event.events = EPOLLIN;
+        event.data.u32 = sh->curr_ci;
+        polled = sh->epoll != -1 && epoll_ctl(sh->epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+    while (1) {
+        set_phase(s, sort_read);
+        ssize_t nb = read(fd, buffer, stream_chunk);
+        if (nb == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (polled) {
+                sh->coros[sh->curr_ci].waiting = 1;
+                sh->waiting++;
+            }
+            yield(s); // woken by the scheduler when data arrives
+            continue;
+        }
+        if (nb == -1 && errno == EINTR) { continue; }
+        if (nb == -1) {
+            fail(s, "Error happened while reading %s!", name);
+            break;
+        }
+        if (nb == 0) { break; }
+        set_phase(s, sort_parse);
+        parse_stream(&st, buffer, nb);
+        set_phase(s, sort_sort);
+        while (st.len - st.sorted >= stream_run) { // sort what we have while the producer writes more
+            sort_ints(st.numbers + st.sorted, stream_run, tmp); // a yield per value would cost more than the sort
+            st.sorted += stream_run;
+        }
+        yield(s);
+    }
+    set_phase(s, sort_sort);
+    if (st.state == 1 && st.digits) { stream_push(&st); }
+    if (polled) { epoll_ctl(sh->epoll, EPOLL_CTL_DEL, fd, NULL); }
+    if (flags != -1) { fcntl(fd, F_SETFL, flags); } // fd may be shared with other processes
+    free(buffer);
+    free(tmp);
+
+    tmp = (int*)checked_malloc((st.len + 1) * sizeof(int));
+    sort_ints(st.numbers + st.sorted, st.len - st.sorted, tmp);
+    for (long width = stream_run; width < st.len; width *= 2) { // merge the runs pairwise
+        for (long lb = 0; lb + width < st.len; lb += 2 * width) {
+            long rb = lb + 2 * width < st.len ? lb + 2 * width : st.len;
+            merge(st.numbers, tmp, lb, lb + width - 1, rb - 1);
+            yield(s);
+        }
+    }
+    free(tmp);
+    result->array = st.numbers;
+    result->len = (int)st.len;
+}
+
+static int sort_fd(struct sorter* s, int id, int fd, const char* name, struct array* result,
+                   struct cache_entry* e, const struct cache_entry* touched) { // text until EOF
+    // e gets the content hash if not NULL, 1 if the run of touched was used instead of sorting
+    struct stat st;
+    size_t len;
+    char* res;
+
+    if (fstat(fd, &st) == -1) {
+        fail(s, "Can't stat %s!", name);
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        sort_stream(s, fd, name, result);
+        return 0;
+    }
+    if (st.st_size >= parallel_threshold) {
+        if (e && touched) { // checking first is cheaper than a sort of a big file
+            e->hashed = file_hash(s, fd, &e->hash);
+            if (reuse_run(s, e, touched, result)) { return 1; }
+        }
+        result->array = parallel_sort(s, fd, st.st_size, &result->len, e && !e->hashed ? &e->hash : NULL, name);
+        if (e) { e->hashed = 1; }
+        return 0;
+    }
+    res = async_read(s, fd, &len, name);
+    if (res == NULL) {
+        result->array = NULL;
+        result->len = 0;
+        return 0;
+    }
+    if (e) { // hashed while in memory, not read again
+        e->hash = text_hash(res, len);
+        e->hashed = 1;
+        if (reuse_run(s, e, touched, result)) {
+            release_text(s, res, len + 1);
+            return 1;
+        }
+    }
+    yield(s);
+    sort_text(s, id, res, result);
+    return 0;
+}
+
+static void sort_file(struct sorter* s, int id, struct array* result) {
+    const char* path = s->inputs[id].path;
+    struct stat st;
+    int known = stat(path, &st) == 0 && S_ISREG(st.st_mode); // not a FIFO, reading it would eat the data
+
+    if (known && is_run(path)) {
+        if (!read_run_file(s, path, result)) { // already sorted (sorter_write_run output)
+            fail(s, "Broken run file %s!", path);
+        }
+        return;
+    }
+    struct cache_entry* e = known && s->cache.dir ? &s->cache.fresh[id] : NULL;
+    struct cache_entry* touched = NULL;
+    if (e && cached_sort(s, id, &st, result, &touched)) {
+        yield(s); // unchanged since the last run
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fail(s, "Can't open file %s!", path);
+        result->array = NULL;
+        result->len = 0;
+        return;
+    }
+    int failed = s->failed;
+    int reused = sort_fd(s, id, fd, path, result, e, touched);
+    close(fd);
+    if (e && s->failed != failed) {
+        e->hashed = 0; // a partial read, keep it out of the manifest
+    } else if (e && !reused) {
+        set_phase(s, sort_write);
+        save_run(s, e, result, &s->histograms[id]);
+    }
+}
+
+static void sort(struct sorter* s) {
+    struct sheduler* sh = &s->sheduler;
+    sh->working_coros++;
+    yield(s);
+    int id = sh->curr_ci-1;
+    struct input* in = &s->inputs[id];
+    struct array result = {NULL, 0};
+    set_phase(s, sort_read);
+    switch (in->kind) {
+        case input_file:
+            sort_file(s, id, &result);
+            break;
+        case input_fd:
+            sort_fd(s, id, in->fd, "descriptor", &result, NULL, NULL);
+            break;
+        case input_text: {
+            char* res = alloc_text(s, in->len);
+            memcpy(res, in->text, in->len);
+            res[in->len] = '\0';
+            sort_text(s, id, res, &result);
+            break;
+        }
+        case input_ints:
+            result.len = (int)in->len;
+            result.array = alloc_ints(s, in->len);
+            memcpy(result.array, in->ints, in->len * sizeof(int));
+            set_phase(s, sort_sort);
+            int* tmp = alloc_ints(s, in->len);
+            merge_sort(s, result.array, tmp, 0, result.len-1);
+            release_ints(s, tmp);
+            break;
+    }
+    yield(s);
+    s->sorted[sh->curr_ci-1].array = result.array;
+    yield(s);
+    s->sorted[sh->curr_ci-1].len = result.len;
+    set_phase(s, sort_phase_n);
+    yield(s);
+    sh->coros[sh->curr_ci].active = 0;
+    sh->coros[sh->curr_ci].ttime += \
+    clock() - sh->coros[sh->curr_ci].work;
+    sh->working_coros--;
+    while (sh->working_coros) { yield(s); }
+    return;
+}
+
+static void sort_entry(unsigned int hi, unsigned int lo) { // makecontext() passes ints only
+    sort((struct sorter*)(uintptr_t)(((unsigned long long)hi << 32) | lo));
+}
+
+static void* allocate_stack() {
+    void* stack = (void*)malloc(stack_size);
+    if (stack == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    return stack;
+}
+
+static void init(struct sorter* s) {
+    struct sheduler* sh = &s->sheduler;
+    unsigned long long p = (uintptr_t)s;
+
+    sh->curr_ci = 1;
+    sh->coros_n = s->inputs_n;
+    sh->working_coros = 0;
+    sh->coros = (struct coroutine*)malloc(
+        (sh->coros_n+1) * sizeof(struct coroutine));
+    if (sh->coros == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i <= sh->coros_n; i++) {
+        if (getcontext(&sh->coros[i].context) == -1) {
+            printf("Can't get context");
+            exit(EXIT_FAILURE);
+        }
+        sh->coros[i].ttime = 0;
+        sh->coros[i].active = 1;
+        sh->coros[i].waiting = 0;
+        sh->coros[i].work = 0;
+        sh->coros[i].stack = allocate_stack();
+        sh->coros[i].context.uc_stack.ss_sp = sh->coros[i].stack;
+        sh->coros[i].context.uc_stack.ss_size = stack_size;
+        sh->coros[i].context.uc_link = &sh->coros[0].context;
+        makecontext(&sh->coros[i].context, (void (*)(void))sort_entry, 2,
+                    (unsigned int)(p >> 32), (unsigned int)p);
+
+    }
+
+    return;
+}
+
+struct sorter* sorter_new(const struct sort_options* options) {
+    struct sorter* s = (struct sorter*)calloc(1, sizeof(struct sorter));
+    if (s == NULL) { return NULL; }
+    s->use_arena = options ? options->use_arena : 1;
+    s->sheduler.epoll = -1;
+    if (options && options->counters) {
+        s->perf = perf_open();
+    }
+    if (options && options->cache_dir) {
+        s->cache.dir = strdup(options->cache_dir);
+    }
+    return s;
+}
+
+static int add_input(struct sorter* s, struct input* in) {
+    if (s->ran) { return -1; }
+    if (s->inputs_n == s->inputs_cap) {
+        int cap = s->inputs_cap ? s->inputs_cap * 2 : 8;
+        struct input* inputs = (struct input*)realloc(s->inputs, cap * sizeof(struct input));
+        if (inputs == NULL) { return -1; }
+        s->inputs = inputs;
+        s->inputs_cap = cap;
+    }
+    s->inputs[s->inputs_n++] = *in;
+    return 0;
+}
+
+int sorter_add_file(struct sorter* s, const char* path) {
+    struct input in = {input_file, path, -1, NULL, NULL, 0};
+    return add_input(s, &in);
+}
+
+int sorter_add_fd(struct sorter* s, int fd) {
+    struct input in = {input_fd, NULL, fd, NULL, NULL, 0};
+    return add_input(s, &in);
+}
+
+int sorter_add_buffer(struct sorter* s, const char* text, size_t len) {
+    struct input in = {input_text, NULL, -1, text, NULL, len};
+    return add_input(s, &in);
+}
+
+int sorter_add_ints(struct sorter* s, const int* values, size_t n) {
+    struct input in = {input_ints, NULL, -1, NULL, values, n};
+    if (n > INT_MAX) { return -1; }
+    return add_input(s, &in);
+}
+
+int sorter_run(struct sorter* s) {
+    if (s->ran) { return -1; }
+    s->ran = 1;
+    s->sorted = (struct array*)calloc(s->inputs_n + 1, sizeof(struct array));
+    s->histograms = (struct histogram*)calloc(s->inputs_n + 1, sizeof(struct histogram));
+    if (s->sorted == NULL || s->histograms == NULL) {
+        printf("Malloc error!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (s->perf) {
+        s->perf->phases = (int*)checked_malloc((s->inputs_n + 1) * sizeof(int));
+        s->perf->counts = (long long*)calloc((long)(s->inputs_n + 1) * (sort_phase_n + 1) * sort_counter_n,
+                                             sizeof(long long));
+        if (s->perf->counts == NULL) {
+            printf("Malloc error!\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i <= s->inputs_n; i++) { s->perf->phases[i] = sort_phase_n; }
+        perf_charge(s->perf); // drop what came before the run
+    }
+    if (s->inputs_n == 0) { return 0; }
+
+    if (s->cache.dir) {
+        s->cache.fresh = (struct cache_entry*)calloc(s->inputs_n, sizeof(struct cache_entry));
+        if (s->cache.fresh == NULL) {
+            printf("Malloc error!\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!load_manifest(s)) {
+            fail(s, "Can't create cache directory %s!", s->cache.dir);
+            return -1;
+        }
+    }
+    if (s->use_arena) {
+        init_arena(s);
+    }
+
+    init(s);
+    if (s->perf) { perf_switch(s->perf, 1); }
+    swapcontext(&s->sheduler.coros[0].context, &s->sheduler.coros[1].context);
+    if (s->perf) { perf_switch(s->perf, 0); }
+    set_phase(s, sort_merge);
+    if (combine_histograms(s)) {
+        s->counted = 1;
+    } else {
+        long total = 0;
+        for (int i = 0; i < s->inputs_n; i++) {
+            total += s->histograms[i].counts ? histogram_len(&s->histograms[i]) : s->sorted[i].len;
+        }
+        if (total > INT_MAX) { // the result is one int-indexed array
+            fail(s, "Too many numbers to merge: %ld!", total);
+            for (int i = 0; i < s->inputs_n; i++) {
+                free(s->histograms[i].counts);
+                s->histograms[i].counts = NULL;
+                release_ints(s, s->sorted[i].array);
+                s->sorted[i].array = NULL;
+                s->sorted[i].len = 0;
+            }
+        }
+        for (int i = 0; i < s->inputs_n; i++) {
+            if (s->histograms[i].counts) {
+                expand_histogram(&s->histograms[i], &s->sorted[i]);
+            }
+        }
+        if (s->arena.map) {
+            merge_all(s, s->sorted, s->inputs_n);
+        } else {
+            merge_arrays(s, s->sorted, s->inputs_n);
+        }
+    }
+    set_phase(s, sort_phase_n);
+    if (s->cache.dir) {
+        save_manifest(s);
+    }
+
+    return s->failed ? -1 : 0;
+}
+
+const char* sorter_error(const struct sorter* s) {
+    return s->failed ? s->error : NULL;
+}
+
+size_t sorter_len(const struct sorter* s) {
+    if (!s->ran) { return 0; }
+    if (!s->counted) { return s->sorted[0].len; }
+    size_t len = 0;
+    for (long i = 0; i < s->histograms[0].size; i++) { len += s->histograms[0].counts[i]; }
+    return len;
+}
+
+int sorter_output(const struct sorter* s, sort_callback callback, void* arg) {
+    if (!s->ran) { return 0; }
+    if (!s->counted) {
+        const struct array* a = &s->sorted[0];
+        for (int i = 0; i < a->len; i += block_values) {
+            if (callback(a->array + i, a->len - i < block_values ? a->len - i : block_values, arg)) { return 1; }
+        }
+        return 0;
+    }
+
+    const struct histogram* h = &s->histograms[0];
+    int values[block_values];
+    size_t n = 0;
+    for (long i = 0; i < h->size; i++) {
+        for (long k = 0; k < h->counts[i]; k++) {
+            values[n++] = (int)(h->min + i);
+            if (n == block_values) {
+                if (callback(values, n, arg)) { return 1; }
+                n = 0;
+            }
+        }
+    }
+    return n && callback(values, n, arg);
+}
+
+struct copy { // sorter_copy() state
+    int* out;
+    size_t cap, len;
+};
+
+static int copy_values(const int* values, size_t n, void* arg) {
+    struct copy* c = (struct copy*)arg;
+    if (n > c->cap - c->len) { n = c->cap - c->len; }
+    memcpy(c->out + c->len, values, n * sizeof(int));
+    c->len += n;
+    return c->len == c->cap;
+}
+
+size_t sorter_copy(const struct sorter* s, int* out, size_t cap) {
+    struct copy c = {out, cap, 0};
+    if (cap) { sorter_output(s, copy_values, &c); }
+    return c.len;
+}
+
+int sorter_write_text(const struct sorter* s, FILE* out) {
+    if (!s->ran) { return -1; }
+    set_phase(s, sort_write);
+    if (!s->counted) {
+        for (int i = 0; i < s->sorted[0].len; i++) {
+            fprintf(out, "%d ", s->sorted[0].array[i]);
+        }
+    } else {
+        const struct histogram* h = &s->histograms[0]; // output straight from the counts
+        char number[16];
+        for (long i = 0; i < h->size; i++) {
+            if (!h->counts[i]) { continue; }
+            int len = sprintf(number, "%d ", (int)(h->min + i));
+            for (long k = 0; k < h->counts[i]; k++) {
+                fwrite(number, 1, len, out);
+            }
+        }
+    }
+    fflush(out);
+    set_phase(s, sort_phase_n);
+    return ferror(out) ? -1 : 0;
+}
+
+int sorter_write_run(const struct sorter* s, FILE* out) {
+    struct run_writer* w = (struct run_writer*)checked_malloc(sizeof(struct run_writer));
+    if (!s->ran) {
+        free(w);
+        return -1;
+    }
+    set_phase(s, sort_write);
+    run_writer_open(w, out);
+    write_values(w, &s->sorted[0], s->counted ? &s->histograms[0] : NULL);
+    run_writer_close(w);
+    fflush(out);
+    set_phase(s, sort_phase_n);
+    free(w);
+    return ferror(out) ? -1 : 0;
+}
+
+long sorter_input_time(const struct sorter* s, int i) {
+    if (!s->sheduler.coros || i < 0 || i >= s->sheduler.coros_n) { return 0; }
+    return s->sheduler.coros[i+1].ttime;
+}
+
+int sorter_counters(const struct sorter* s, int i, enum sort_phase phase, long long values[sort_counter_n]) {
+    struct perf* perf = s->perf;
+    if (perf == NULL || perf->counts == NULL || i < -1 || i >= s->inputs_n || phase >= sort_phase_n) { return -1; }
+    long long* counts = perf->counts + ((long)(i + 1) * (sort_phase_n + 1) + phase) * sort_counter_n;
+    for (int k = 0; k < sort_counter_n; k++) { values[k] = -1; }
+    for (int k = 0; k < perf->n; k++) { values[perf->kinds[k]] = counts[perf->kinds[k]]; }
+    return 0;
+}
+
+int sorter_cache_hits(const struct sorter* s) {
+    return s->cache.hits;
+}
+
+const char* sorter_arena(const struct sorter* s, size_t* size) {
+    if (!s->arena.map) { return NULL; }
+    if (size) { *size = s->arena.size; }
+    return s->arena.huge == 2 ? "MAP_HUGETLB" : s->arena.huge ? "MADV_HUGEPAGE" : "small pages";
+}
+
+void sorter_free(struct sorter* s) {
+    if (s == NULL) { return; }
+    for (int i = 1; i <= s->sheduler.coros_n; i++) {
+        free(s->sheduler.coros[i].stack);
+    }
+    free(s->sheduler.coros);
+    if (s->sheduler.epoll != -1) {
+        close(s->sheduler.epoll);
+    }
+    if (s->sorted) {
+        if (s->counted) {
+            free(s->histograms[0].counts);
+        } else {
+            release_ints(s, s->sorted[0].array);
+        }
+    }
+    free(s->sorted);
+    free(s->histograms);
+    for (int i = 0; i < s->cache.old_n; i++) {
+        free(s->cache.old[i].path);
+    }
+    for (int i = 0; s->cache.fresh && i < s->inputs_n; i++) {
+        free(s->cache.fresh[i].path);
+    }
+    free(s->cache.old);
+    free(s->cache.index);
+    free(s->cache.fresh);
+    free(s->cache.dir);
+    if (s->arena.map) {
+        munmap(s->arena.map, s->arena.size);
+    }
+    if (s->perf) {
+        for (int i = 0; i < s->perf->n; i++) { close(s->perf->fds[i]); }
+        free(s->perf->phases);
+        free(s->perf->counts);
+        free(s->perf);
+    }
+    free(s->inputs);
+    free(s);
+}
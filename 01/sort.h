@@ -0,0 +1,72 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Coroutine merge sort of whitespace separated numbers, one coroutine per input.
+// A sorter has no shared state, several of them may run in different threads.
+//
+//     struct sorter* s = sorter_new(NULL);
+//     sorter_add_file(s, "a.txt");
+//     sorter_add_buffer(s, text, len);
+//     if (sorter_run(s) == -1) { puts(sorter_error(s)); }
+//     sorter_output(s, callback, arg);
+//     sorter_free(s);
+
+struct sorter;
+
+struct sort_options {
+    int use_arena; // 1 - all buffers in one hugepage mapping sized from the inputs
+    const char* cache_dir; // sorted runs of unchanged files are reused, NULL - no cache
+    int counters; // 1 - perf_event_open() counters per input and phase, costs a read() per switch
+};
+
+enum sort_phase {
+    sort_read,
+    sort_parse,
+    sort_sort, // merge sort of one input
+    sort_merge, // of all inputs
+    sort_write,
+    sort_phase_n
+};
+
+enum sort_counter {
+    sort_cycles,
+    sort_instructions,
+    sort_branch_misses,
+    sort_llc_misses,
+    sort_page_faults,
+    sort_counter_n
+};
+
+// Gets the next n sorted values, returns non-zero to stop the output.
+typedef int (*sort_callback)(const int* values, size_t n, void* arg);
+
+struct sorter* sorter_new(const struct sort_options* options); // NULL - defaults
+void sorter_free(struct sorter* s);
+
+// Inputs are only read by sorter_run(), they must stay valid until then.
+int sorter_add_file(struct sorter* s, const char* path); // text or a run written by sorter_write_run()
+int sorter_add_fd(struct sorter* s, int fd); // text until EOF, fd is not closed
+                                             // pipes are parsed as data arrives, O_NONBLOCK while read
+int sorter_add_buffer(struct sorter* s, const char* text, size_t len);
+int sorter_add_ints(struct sorter* s, const int* values, size_t n);
+
+int sorter_run(struct sorter* s); // 0, or -1 and sorter_error() if an input failed
+const char* sorter_error(const struct sorter* s);
+
+size_t sorter_len(const struct sorter* s);
+int sorter_output(const struct sorter* s, sort_callback callback, void* arg); // 1 if stopped
+size_t sorter_copy(const struct sorter* s, int* out, size_t cap); // at most cap values
+int sorter_write_text(const struct sorter* s, FILE* out); // "1 2 3 ", 0 or -1
+int sorter_write_run(const struct sorter* s, FILE* out); // delta+varint blocks, 0 or -1
+
+long sorter_input_time(const struct sorter* s, int i); // clock() ticks spent in input i
+int sorter_cache_hits(const struct sorter* s);
+const char* sorter_arena(const struct sorter* s, size_t* size); // pages used, NULL if no arena
+// Counters of input i in a phase, i = -1 for merging and output. 0, or -1 if there are
+// none; a counter the kernel refused is -1. Threads of big files are not counted.
+int sorter_counters(const struct sorter* s, int i, enum sort_phase phase, long long values[sort_counter_n]);
+
+#endif
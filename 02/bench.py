@@ -0,0 +1,125 @@
+import subprocess
+import argparse
+import json
+import os
+import signal
+import tempfile
+import time
+
+parser = argparse.ArgumentParser(description='Benchmarks for shell')
+parser.add_argument('-e', type=str, default='./a.out',
+		    help='executable shell file')
+parser.add_argument('-n', type=int, default=2000,
+		    help='commands per run')
+parser.add_argument('-r', type=int, default=3,
+		    help='runs per case, the best one is reported')
+parser.add_argument('--mb', type=int, default=512,
+		    help='megabytes sent through the pipeline benchmarks')
+parser.add_argument('--jobs', type=int, default=1000,
+		    help='live background jobs for the scaling benchmark')
+parser.add_argument('--names', type=str, default='0,100000,400000',
+		    help='directory names the shell caches before the launch latency benchmark')
+parser.add_argument('--json', type=str,
+		    help='write results to this file')
+parser.add_argument('--baseline', type=str,
+		    help='results of an earlier run (--json) to compare with')
+args = parser.parse_args()
+
+results = {}
+
+def run(script, options=[]):
+	best = None
+	for _ in range(args.r):
+		start = time.perf_counter()
+		p = subprocess.Popen([args.e] + options, stdin=subprocess.PIPE,
+				     stdout=subprocess.DEVNULL, start_new_session=True)
+		p.communicate(script.encode())
+		elapsed = time.perf_counter() - start
+		try:
+			os.killpg(p.pid, signal.SIGKILL) # background jobs left behind
+		except ProcessLookupError:
+			pass
+		if best is None or elapsed < best:
+			best = elapsed
+	return best
+
+def report(name, value, unit):
+	results[name] = {'value': value, 'unit': unit}
+	print('%-32s %12.1f %s' % (name, value, unit))
+
+# parse throughput: complex lines of builtins, distinct (plan cache misses) and repeated (hits)
+line = 'echo "a b" \'c\' %d > /dev/null && test %d -gt 0 || false ; printf "%%s" x > /dev/null'
+report('parse distinct', args.n / run(''.join(line % (i, i) + '\n' for i in range(args.n))), 'lines/s')
+report('parse repeated', args.n / run((line % (1, 1) + '\n') * args.n), 'lines/s')
+
+# spawn cost: time per external command over the shell's own startup, plain fork(), fork server (-z), subshell
+def spawn(line, options=[]):
+	return (run(line * args.n, options) - run('', options)) / args.n * 1e6
+
+report('spawn fork', spawn('/bin/true\n'), 'us')
+report('spawn fork server', spawn('/bin/true\n', ['-z']), 'us')
+report('spawn subshell', spawn('(/bin/true)\n'), 'us')
+
+def shell_size(script):
+	p = subprocess.Popen([args.e], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+	out, _ = p.communicate((script + 'grep VmRSS /proc/%d/status\n' % p.pid).encode())
+	return int(out.split()[-2]) >> 10
+
+# launch latency as the shell grows: fork() copies page tables, the fork server stays small.
+# The shell grows the way a long session does, here by caching the listing of a big directory.
+n = args.n # enough launches to outweigh the scan at startup
+with tempfile.TemporaryDirectory() as d:
+	files = 0
+	for names in [int(x) for x in args.names.split(',')]:
+		for i in range(files, names):
+			open(os.path.join(d, '%0200d' % i), 'w').close() # long names, more memory per entry
+		files = max(files, names)
+		os.utime(d, (time.time() - 10, time.time() - 10)) # listings of just changed directories are not kept
+		grow = 'echo %s/*.none > /dev/null\n' % d if names else ''
+		print('shell with %d cached names: %d MB' % (names, shell_size(grow)))
+		for name, options in [('fork', []), ('fork server', ['-z'])]:
+			start = run(grow, options)
+			report('launch %s %dk names' % (name, names // 1000),
+			       (run(grow + '/bin/true\n' * n, options) - start) / n * 1e6, 'us')
+
+# pipeline throughput through N stages, default pipes and enlarged ones (pipesize)
+for stages in [2, 4]:
+	line = 'head -c %dM /dev/zero' % args.mb + ' | cat' * (stages - 2) + ' | wc -c\n'
+	for size in [0, 1 << 20]:
+		report('pipeline %d stages %s' % (stages, 'pipesize 1M' if size else 'default'),
+		       args.mb / run('pipesize %d\n' % size + line), 'MB/s')
+
+# background-job scaling: latency of a command with many live jobs
+n = args.n // 4
+for jobs in [0, args.jobs]:
+	start = 'sleep 60 &\n' * jobs
+	report('latency with %d jobs' % jobs,
+	       (run(start + '/bin/true\n' * n) - run(start)) / n * 1e6, 'us')
+
+# input reading: a large script that is mostly comments
+line = '# ' + 'x' * 200 + '\n'
+report('input reading', len(line) * args.n * 20 / run(line * args.n * 20) / 1e6, 'MB/s')
+
+# glob expansion: a big directory, scanned once and then served from the listing cache
+with tempfile.TemporaryDirectory() as d:
+	files = args.n * 10
+	for i in range(files):
+		open(os.path.join(d, '%d.txt' % i), 'w').close()
+	os.utime(d, (time.time() - 10, time.time() - 10)) # listings of just changed directories are not kept
+	n = 100
+	report('glob %d files' % files, n / run(('echo %s/*.txt > /dev/null\n' % d) * n), 'expansions/s')
+
+if args.json:
+	with open(args.json, 'w') as f:
+		json.dump(results, f, indent=1)
+
+if args.baseline:
+	with open(args.baseline) as f:
+		baseline = json.load(f)
+	print('\nspeedup over the baseline (> 1 is better):')
+	for name, result in results.items():
+		if name in baseline and baseline[name]['value'] > 0 and result['value'] > 0:
+			ratio = result['value'] / baseline[name]['value']
+			if result['unit'] == 'us': # time, lower is better
+				ratio = 1 / ratio
+			print('%-32s %8.2fx' % (name, ratio))
@@ -1,18 +1,39 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
 #include <setjmp.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_COMMAND_LENGTH 1024
 #define MAX_STR 1024
 #define INVITE "$ "
+#define INPUT_CHUNK (1 << 20) // script read() size
+#define OUTPUT_BUFFER (1 << 16) // stdout buffer in non-interactive mode
+#define PLAN_CACHE_SIZE 256 // parsed lines kept in cache
+#define PLAN_BUCKETS 512
+#define COPY_CHUNK (1 << 30) // bytes per splice()/sendfile() call
+#define COPY_BUFFER (1 << 16) // fallback read()/write() buffer
+#define ZYGOTE_MESSAGE (1 << 16) // max size of a launch request
+#define GLOB_DIRS 64 // directory listings kept for glob expansion
+#define DENTS_BUFFER (1 << 18) // getdents64() batch size
 
 char buffer[MAX_COMMAND_LENGTH]; // Command buffer
 char token[MAX_COMMAND_LENGTH+2]; // Current token
@@ -20,15 +41,74 @@ int cursor = 0; // Current position in token string
 
 jmp_buf point;
 
-struct pid_bg { // Background process PID
+int interactive = 1; // 0 if commands come from a script or a pipe
+int exec_tail = 0; // 1 in a forked subshell: its last command replaces the process
+int pipe_size = 0; // capacity of conveyor pipes, 0 - system default
+
+struct input { // Script reader for non-interactive mode
+    int fd;
+    char *buf;
+    ssize_t len, pos;
+} input;
+
+struct job { // Background job
+    pid_t pid;
+    int id;
+    char *name;
+    struct timespec start;
+    struct job *next_hash; // next job in the same bucket
+    struct job *prev_job, *next_job; // jobs in start order
+};
+
+struct job_table { // Background jobs indexed by PID
+    struct job **buckets;
+    size_t size; // number of buckets, power of two
+    int count;
+    int last_id;
+    struct job *first, *last;
+} jobs;
+
+int sigchld_pipe[2] = {-1, -1}; // SIGCHLD handler -> main loop
+
+struct usage { // Resources of all waited children
+    double user, sys; // seconds
+    long maxrss; // KB, maximum over children
+    long nvcsw, nivcsw; // context switches
+} usage;
+
+FILE *trace; // JSON lines log of finished commands, if not NULL
+
+struct launch_request { // shell -> fork server, stdin/stdout/stderr go as SCM_RIGHTS
+    int append;
+    int argc;
+    size_t len; // cwd, input file, output file and argv follow, each ends with '\0'
+};
+
+struct launch_reply { // fork server -> shell
+    int exited; // 0 - started, 1 - exited
+    pid_t pid; // -1 if fork() failed
+    int status;
+    struct rusage ru;
+};
+
+struct remote_child { // Started by the fork server, not waited yet
     pid_t pid;
-    struct pid_bg *next_pid;
+    int done;
+    int status;
+    struct rusage ru;
 };
 
-struct pid_bg *bg_list = NULL; // Background processes list
+struct zygote { // Fork server, started while the shell is still small
+    int sock; // -1 if not used
+    struct remote_child *children;
+    int count, size;
+} zygote = {-1, NULL, 0, 0};
+volatile sig_atomic_t sigchld_flag = 0; // set, if pipe has to be drained
 
 struct cmd { // Command struct
     char **argv; // Command name and arguments
+    char *patterns; // patterns[i] = 1, if argv[i] is expanded when the command runs
+    int patterns_n; // length of patterns, 0 if there are none
 
     char *input_file; // <
     char *output_file; // > and >>
@@ -39,6 +119,8 @@ struct cmd { // Command struct
     int and;  // = 1, if separator is &&
     int or; // = 1, if separator is ||
 
+    int timed; // = 1, if the conveyor starts with 'time' (set on its first command)
+
     struct cmd *subcmd; // (subcommand)
     struct cmd *next; // next command after ';'
     struct cmd *pipe; // next command after '|'
@@ -46,12 +128,59 @@ struct cmd { // Command struct
 
 struct cmd *head; // head to struct command tree
 
+struct plan { // Parsed command line, never changed after parse()
+    char *line;
+    size_t hash;
+    struct cmd *tree;
+    struct plan *next_hash; // next plan in the same bucket
+    struct plan *prev, *next; // most recently used first
+};
+
+struct plan_cache { // LRU cache of parsed lines
+    struct plan *buckets[PLAN_BUCKETS];
+    struct plan *first, *last;
+    int count;
+    unsigned long hits, misses;
+} plans;
+
+struct linux_dirent64 { // getdents64() record
+    ino_t d_ino;
+    off_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_entry {
+    char *name;
+    unsigned char type; // DT_*, DT_UNKNOWN on some filesystems
+};
+
+struct listing { // Sorted names of a directory, valid while its mtime holds
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t scanned;
+    char *names; // all names, '\0' separated
+    struct dir_entry *entries;
+    size_t count;
+    int busy; // being expanded, not to be dropped
+    struct listing *next; // most recently used first
+};
+
+struct dir_cache { // Directory listings of earlier glob expansions
+    struct listing *first;
+    size_t count;
+    unsigned long hits, scans;
+} dirs;
+
 char *ss;
 int ns;
 
 void free_memory(struct cmd *head); // free
 
 int error(const char *message, int fatal) { // error handler
+    fflush(stdout);
     fprintf(stderr, "%s\n", message);
     if (fatal) {
         free_memory(head);
@@ -61,53 +190,462 @@ int error(const char *message, int fatal) { // error handler
     return 1;
 }
 
-void add_process(pid_t process) {
-    struct pid_bg **p = &bg_list;
-    while (*p) {
-        p = &((*p)->next_pid);
+char *grow(char *buff, size_t *cap, size_t len) { // realloc with doubling
+    if (len <= *cap)
+        return buff;
+    *cap = *cap ? *cap * 2 : 128;
+    if (*cap < len)
+        *cap = len;
+    buff = (char *)realloc(buff, *cap);
+    if (buff == NULL)
+        error("Realloc error.", 1);
+
+    return buff;
+}
+
+void sigchld_handler(int sig) {
+    int saved = errno;
+    sigchld_flag = 1;
+    if (write(sigchld_pipe[1], "", 1) == -1) {
+        // the pipe is full: the main loop is already woken up
+    }
+    errno = saved;
+}
+
+void init_jobs() {
+    struct sigaction sa;
+
+    jobs.size = 64;
+    jobs.buckets = (struct job **)calloc(jobs.size, sizeof(struct job *));
+    if (pipe(sigchld_pipe))
+        error("Pipe error.", 0);
+    for (int i = 0; i < 2; i++) {
+        fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+size_t job_hash(pid_t pid) {
+    return ((size_t)pid * 2654435761u) & (jobs.size - 1);
+}
+
+void grow_jobs() {
+    size_t old_size = jobs.size;
+    struct job **old = jobs.buckets;
+    struct job *p, *next;
+
+    jobs.size *= 2;
+    jobs.buckets = (struct job **)calloc(jobs.size, sizeof(struct job *));
+    for (size_t i = 0; i < old_size; i++) {
+        for (p = old[i]; p; p = next) {
+            next = p->next_hash;
+            p->next_hash = jobs.buckets[job_hash(p->pid)];
+            jobs.buckets[job_hash(p->pid)] = p;
+        }
     }
+    free(old);
+}
 
-    *p = (struct pid_bg *)malloc(sizeof(struct pid_bg));
-    (*p)->pid = process;
-    (*p)->next_pid = NULL;
+void add_process(pid_t process, const char *name) {
+    struct job *p = (struct job *)malloc(sizeof(struct job));
+    size_t h;
+
+    if (jobs.count >= (int)jobs.size)
+        grow_jobs();
+    h = job_hash(process);
+
+    p->pid = process;
+    p->id = jobs.count ? ++jobs.last_id : (jobs.last_id = 1);
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    p->name = strdup(name);
+    p->next_hash = jobs.buckets[h];
+    jobs.buckets[h] = p;
+    p->prev_job = jobs.last;
+    p->next_job = NULL;
+    if (jobs.last)
+        jobs.last->next_job = p;
+    else
+        jobs.first = p;
+    jobs.last = p;
+    jobs.count++;
 
     return;
 }
 
-void delete_process(pid_t process) {
-    struct pid_bg **p = &bg_list;
-    struct pid_bg *target;
-    while (*p) {
-        if ((*p)->pid == process) {
-            target = *p;
-            *p = (*p)->next_pid;
-            free(target);
-            return;
+struct job *find_process(pid_t process) {
+    struct job *p;
+    if (!jobs.buckets)
+        return NULL;
+    for (p = jobs.buckets[job_hash(process)]; p && p->pid != process; p = p->next_hash);
+
+    return p;
+}
+
+int delete_process(pid_t process) { // 1 if process was not a background job
+    struct job **p;
+    struct job *target;
+
+    if (!jobs.buckets)
+        return 1;
+    for (p = &jobs.buckets[job_hash(process)]; *p && (*p)->pid != process; p = &((*p)->next_hash));
+    if (!(target = *p))
+        return 1;
+
+    *p = target->next_hash;
+    if (target->prev_job)
+        target->prev_job->next_job = target->next_job;
+    else
+        jobs.first = target->next_job;
+    if (target->next_job)
+        target->next_job->prev_job = target->prev_job;
+    else
+        jobs.last = target->prev_job;
+    jobs.count--;
+    free(target->name);
+    free(target);
+
+    return 0;
+}
+
+int status_code(int status) { // wait() status -> shell exit status
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+
+    return 1;
+}
+
+double seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void trace_string(const char *str) { // JSON string
+    fputc('"', trace);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\')
+            fprintf(trace, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(trace, "\\u%04x", *str);
+        else
+            fputc(*str, trace);
+    }
+    fputc('"', trace);
+}
+
+void trace_command(pid_t pid, const char *name, int status, double real,
+                   double user, double sys, long maxrss, long nvcsw, long nivcsw) {
+    if (!trace)
+        return;
+    fprintf(trace, "{\"pid\":%d,\"cmd\":", pid);
+    trace_string(name);
+    fprintf(trace, ",\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+            "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+            status, real, user, sys, maxrss, nvcsw, nivcsw);
+}
+
+struct remote_child *find_remote(pid_t pid) {
+    for (int i = 0; i < zygote.count; i++) {
+        if (zygote.children[i].pid == pid)
+            return &zygote.children[i];
+    }
+
+    return NULL;
+}
+
+int zygote_receive(struct launch_reply *reply) { // 0 if the fork server is gone
+    struct remote_child *child;
+    ssize_t n;
+
+    while ((n = recv(zygote.sock, reply, sizeof(*reply), 0)) == -1 && errno == EINTR);
+    if (n == sizeof(*reply)) {
+        if (reply->exited && (child = find_remote(reply->pid))) {
+            child->done = 1;
+            child->status = reply->status;
+            child->ru = reply->ru;
+        }
+        return 1;
+    }
+
+    error("Fork server error: exited.", 0); // nobody can wait for its children now
+    close(zygote.sock);
+    zygote.sock = -1;
+    for (int i = 0; i < zygote.count; i++) {
+        if (!zygote.children[i].done) {
+            zygote.children[i].done = 1;
+            zygote.children[i].status = 127 << 8;
+            memset(&zygote.children[i].ru, 0, sizeof(struct rusage));
         }
-        p = &((*p)->next_pid);
     }
 
-    error("Delete process error: not found process in list.", 1);
+    return 0;
 }
 
-void print_list() {
-    struct pid_bg **p = &bg_list;
-    int status;
-    while (*p) {
-        waitpid((*p)->pid, &status, WNOHANG);
-        if (WIFEXITED(status)) {
-            // printf("Done: %d\n", (*p)->pid);
-            delete_process((*p)->pid);
-            continue;
-        } else {
-            // printf("%d\n", (*p)->pid);
+int remote_wait(pid_t pid, int *status, struct rusage *ru) { // 1 if pid was started by the fork server
+    struct remote_child *child = find_remote(pid);
+    struct launch_reply reply;
+
+    if (!child)
+        return 0;
+    while (!child->done && zygote_receive(&reply));
+    *status = child->status;
+    *ru = child->ru;
+    *child = zygote.children[--zygote.count];
+
+    return 1;
+}
+
+pid_t wait_process(pid_t pid, int *status, int options,
+                   const char *name, const struct timespec *start) { // waitpid() that keeps rusage
+    struct rusage ru;
+    struct job *job;
+    pid_t res;
+
+    if (pid > 0 && remote_wait(pid, status, &ru))
+        res = pid;
+    else
+        while ((res = wait4(pid, status, options, &ru)) == -1 && errno == EINTR);
+    if (res <= 0)
+        return res;
+
+    usage.user += seconds(&ru.ru_utime);
+    usage.sys += seconds(&ru.ru_stime);
+    if (ru.ru_maxrss > usage.maxrss)
+        usage.maxrss = ru.ru_maxrss;
+    usage.nvcsw += ru.ru_nvcsw;
+    usage.nivcsw += ru.ru_nivcsw;
+    if (trace) {
+        if (!name && (job = find_process(res))) {
+            name = job->name;
+            start = &job->start;
         }
-        p = &((*p)->next_pid);
+        trace_command(res, name ? name : "?", status_code(*status), start ? elapsed(start) : 0,
+                      seconds(&ru.ru_utime), seconds(&ru.ru_stime), ru.ru_maxrss,
+                      ru.ru_nvcsw, ru.ru_nivcsw);
+    }
+
+    return res;
+}
+
+void reap_processes() { // reap finished jobs, only if SIGCHLD came
+    char drain[64];
+    int status, woken = 0;
+    pid_t pid;
+
+    if (!sigchld_flag)
+        return;
+    sigchld_flag = 0;
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0)
+        woken = 1;
+    if (!woken)
+        return;
+    while ((pid = wait_process(-1, &status, WNOHANG, NULL, NULL)) > 0) {
+        // printf("Done: %d\n", pid);
+        delete_process(pid);
     }
 
     return;
 }
 
+size_t line_hash(const char *line) { // FNV-1a
+    size_t h = 2166136261u;
+    while (*line)
+        h = (h ^ (unsigned char)*(line++)) * 16777619u;
+
+    return h;
+}
+
+void unlink_plan(struct plan *p) {
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        plans.first = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        plans.last = p->prev;
+}
+
+void push_plan(struct plan *p) { // make p the most recently used
+    p->prev = NULL;
+    p->next = plans.first;
+    if (plans.first)
+        plans.first->prev = p;
+    else
+        plans.last = p;
+    plans.first = p;
+}
+
+const struct cmd *find_plan(const char *line) {
+    size_t h = line_hash(line);
+    struct plan *p;
+
+    for (p = plans.buckets[h % PLAN_BUCKETS]; p; p = p->next_hash) {
+        if (p->hash == h && !strcmp(p->line, line)) {
+            plans.hits++;
+            unlink_plan(p);
+            push_plan(p);
+            return p->tree;
+        }
+    }
+    plans.misses++;
+
+    return NULL;
+}
+
+void drop_plan(struct plan *p) {
+    struct plan **b;
+
+    for (b = &plans.buckets[p->hash % PLAN_BUCKETS]; *b != p; b = &((*b)->next_hash));
+    *b = p->next_hash;
+    unlink_plan(p);
+    plans.count--;
+    free_memory(p->tree);
+    free(p->line);
+    free(p);
+}
+
+const struct cmd *add_plan(const char *line, struct cmd *tree) { // cache takes the tree
+    struct plan *p = (struct plan *)malloc(sizeof(struct plan));
+
+    if (plans.count == PLAN_CACHE_SIZE)
+        drop_plan(plans.last);
+    p->line = strdup(line);
+    p->hash = line_hash(line);
+    p->tree = tree;
+    p->next_hash = plans.buckets[p->hash % PLAN_BUCKETS];
+    plans.buckets[p->hash % PLAN_BUCKETS] = p;
+    push_plan(p);
+    plans.count++;
+
+    return tree;
+}
+
+void free_listing(struct listing *l) {
+    free(l->names);
+    free(l->entries);
+    free(l);
+}
+
+void drop_listings(size_t keep) { // the least recently used ones, until keep are left
+    struct listing **p = &dirs.first;
+    for (size_t i = 0; *p; i++) {
+        if (i >= keep && !(*p)->busy) {
+            struct listing *l = *p;
+            *p = l->next;
+            free_listing(l);
+            dirs.count--;
+        } else {
+            p = &(*p)->next;
+        }
+    }
+}
+
+int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct dir_entry *)a)->name, ((const struct dir_entry *)b)->name);
+}
+
+struct listing *scan_dir(const char *dir, const struct stat *st) { // NULL if dir can't be read
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    struct listing *l = (struct listing *)calloc(1, sizeof(struct listing));
+    char *batch = (char *)malloc(DENTS_BUFFER);
+    size_t cap = 0, len = 0, ecap = 0;
+    size_t *offsets = NULL;
+    unsigned char *types = NULL;
+    long nb;
+
+    if (l == NULL || batch == NULL)
+        error("Malloc error.", 1);
+    while ((nb = syscall(SYS_getdents64, fd, batch, DENTS_BUFFER)) > 0) { // thousands of names per call
+        for (long off = 0; off < nb;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(batch + off);
+            off += d->d_reclen;
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                continue;
+            size_t n = strlen(d->d_name) + 1;
+            l->names = grow(l->names, &cap, len + n);
+            memcpy(l->names + len, d->d_name, n);
+            if (l->count == ecap) {
+                ecap = ecap ? ecap * 2 : 256;
+                offsets = (size_t *)realloc(offsets, ecap * sizeof(size_t));
+                types = (unsigned char *)realloc(types, ecap);
+                if (offsets == NULL || types == NULL)
+                    error("Realloc error.", 1);
+            }
+            offsets[l->count] = len;
+            types[l->count++] = d->d_type;
+            len += n;
+        }
+    }
+    close(fd);
+    free(batch);
+
+    l->entries = (struct dir_entry *)malloc((l->count + 1) * sizeof(struct dir_entry));
+    if (l->entries == NULL)
+        error("Malloc error.", 1);
+    for (size_t i = 0; i < l->count; i++) { // names don't move any more
+        l->entries[i].name = l->names + offsets[i];
+        l->entries[i].type = types[i];
+    }
+    free(offsets);
+    free(types);
+    qsort(l->entries, l->count, sizeof(struct dir_entry), compare_entries);
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    l->mtime = st->st_mtim;
+    l->scanned = time(NULL);
+
+    return l;
+}
+
+struct listing *get_listing(const char *dir) { // cached while the directory's mtime holds
+    struct stat st;
+    struct listing **p, *l;
+
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+    for (p = &dirs.first; *p && ((*p)->dev != st.st_dev || (*p)->ino != st.st_ino); p = &(*p)->next);
+    if ((l = *p)) {
+        *p = l->next;
+        dirs.count--;
+        // changes in the second of the scan may keep the mtime, such listings are read again
+        if (l->busy || (l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+                        l->mtime.tv_sec < l->scanned)) {
+            dirs.hits++;
+        } else {
+            free_listing(l);
+            l = NULL;
+        }
+    }
+    if (!l) {
+        if (!(l = scan_dir(dir, &st)))
+            return NULL;
+        dirs.scans++;
+    }
+    l->next = dirs.first;
+    dirs.first = l;
+    dirs.count++;
+    if (dirs.count > GLOB_DIRS)
+        drop_listings(GLOB_DIRS);
+
+    return l;
+}
+
 void print_cmd(struct cmd *this, char *which) {
     printf("\n--------------------");
     printf("\n%s\n\n", which);
@@ -131,27 +669,738 @@ void print_cmd(struct cmd *this, char *which) {
         printf("Next: %s\n", *this->next->argv);
     printf("--------------------\n");
 
-    return;
+    return;
+}
+
+int escape(const char **str) { // *str points after '\', returns char or -1 for \c
+    const char *p = *str;
+    int c = 0;
+
+    switch (*p) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'c': return -1;
+        case 'e': c = 27; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+        case '\\': c = '\\'; break;
+        case '0': case '1': case '2': case '3':
+        case '4': case '5': case '6': case '7':
+            if (*p == '0')
+                ++p;
+            for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++)
+                c = c * 8 + *(p++) - '0';
+            *str = p - 1;
+            return c & 0xff;
+        case '\0':
+            *str = p - 1;
+            return '\\';
+        default:
+            putchar('\\');
+            c = *p;
+    }
+
+    return c;
+}
+
+int put_escaped(const char *str) { // returns 1 if output must be stopped (\c)
+    int c;
+    for (; *str; ++str) {
+        if (*str != '\\') {
+            putchar(*str);
+            continue;
+        }
+        ++str;
+        if ((c = escape(&str)) == -1)
+            return 1;
+        putchar(c);
+    }
+
+    return 0;
+}
+
+int builtin_exit(char **argv) {
+    fflush(stdout);
+    exit(argv[1] ? atoi(argv[1]) : 0);
+}
+
+int builtin_cd(char **argv) {
+    const char *dir = argv[1] ? argv[1] : getenv("HOME");
+    if (!dir || chdir(dir))
+        return error("Cd error: arguments are not correct.", 0);
+
+    return 0;
+}
+
+int builtin_pwd(char **argv) {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return error("Pwd error: can't get current directory.", 0);
+    puts(cwd);
+
+    return 0;
+}
+
+int builtin_true(char **argv) {
+    return 0;
+}
+
+int builtin_false(char **argv) {
+    return 1;
+}
+
+int builtin_echo(char **argv) {
+    int newline = 1, escapes = 0;
+    char **arg = argv + 1;
+
+    // Options are accepted only while every letter is one of -n, -e, -E
+    while (*arg && (*arg)[0] == '-' && (*arg)[1] &&
+           strspn(*arg + 1, "neE") == strlen(*arg + 1)) {
+        for (char *p = *arg + 1; *p; ++p) {
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = (*p == 'e');
+        }
+        ++arg;
+    }
+
+    for (; *arg; ++arg) {
+        if (!escapes)
+            fputs(*arg, stdout);
+        else if (put_escaped(*arg))
+            return 0;
+        if (arg[1])
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+
+    return 0;
+}
+
+int builtin_printf(char **argv) {
+    char spec[32];
+    char **arg, **start;
+    const char *f, *a;
+    int c;
+    size_t n;
+
+    if (!argv[1]) {
+        fflush(stdout);
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    arg = argv + 2;
+    do { // the format is reused while arguments remain
+        start = arg;
+        for (f = argv[1]; *f; ++f) {
+            if (*f == '\\') {
+                ++f;
+                if ((c = escape(&f)) == -1)
+                    return 0;
+                putchar(c);
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar(*(++f));
+                continue;
+            }
+
+            n = 0;
+            spec[n++] = *(f++);
+            while (*f && strchr("-+ #0", *f) && n < 8)
+                spec[n++] = *(f++);
+            while (*f >= '0' && *f <= '9' && n < 16)
+                spec[n++] = *(f++);
+            if (*f == '.') {
+                spec[n++] = *(f++);
+                while (*f >= '0' && *f <= '9' && n < 24)
+                    spec[n++] = *(f++);
+            }
+            a = *arg ? *(arg++) : "";
+
+            switch (*f) {
+                case 'd': case 'i':
+                    strcpy(spec + n, "lld");
+                    printf(spec, strtoll(a, NULL, 0));
+                    break;
+                case 'u': case 'o': case 'x': case 'X':
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printf(spec, strtoull(a, NULL, 0));
+                    break;
+                case 'c':
+                    strcpy(spec + n, "c");
+                    printf(spec, *a);
+                    break;
+                case 's':
+                    strcpy(spec + n, "s");
+                    printf(spec, a);
+                    break;
+                case 'b':
+                    if (put_escaped(a))
+                        return 0;
+                    break;
+                default:
+                    fflush(stdout);
+                    fprintf(stderr, "printf: %%%c: invalid directive\n", *f);
+                    return 1;
+            }
+        }
+    } while (*arg && arg != start);
+
+    return 0;
+}
+
+int test_unary(const char *op, const char *a) { // -1 if op is not unary
+    struct stat st;
+
+    if (op[0] != '-' || !op[1] || op[2])
+        return -1;
+    switch (op[1]) {
+        case 'z': return !(*a == '\0');
+        case 'n': return !(*a != '\0');
+        case 'e': return stat(a, &st) != 0;
+        case 'f': return !(stat(a, &st) == 0 && S_ISREG(st.st_mode));
+        case 'd': return !(stat(a, &st) == 0 && S_ISDIR(st.st_mode));
+        case 's': return !(stat(a, &st) == 0 && st.st_size > 0);
+        case 'h':
+        case 'L': return !(lstat(a, &st) == 0 && S_ISLNK(st.st_mode));
+        case 'p': return !(stat(a, &st) == 0 && S_ISFIFO(st.st_mode));
+        case 'S': return !(stat(a, &st) == 0 && S_ISSOCK(st.st_mode));
+        case 'b': return !(stat(a, &st) == 0 && S_ISBLK(st.st_mode));
+        case 'c': return !(stat(a, &st) == 0 && S_ISCHR(st.st_mode));
+        case 'g': return !(stat(a, &st) == 0 && (st.st_mode & S_ISGID));
+        case 'u': return !(stat(a, &st) == 0 && (st.st_mode & S_ISUID));
+        case 'k': return !(stat(a, &st) == 0 && (st.st_mode & S_ISVTX));
+        case 'r': return access(a, R_OK) != 0;
+        case 'w': return access(a, W_OK) != 0;
+        case 'x': return access(a, X_OK) != 0;
+        case 't': {
+            char *end;
+            long fd = strtol(a, &end, 10);
+            if (!*a || *end)
+                return 2;
+            return !(fd >= 0 && fd <= INT_MAX && isatty((int)fd));
+        }
+        default: return -1;
+    }
+}
+
+int newer(const struct stat *x, const struct stat *y) {
+    return x->st_mtim.tv_sec > y->st_mtim.tv_sec ||
+           (x->st_mtim.tv_sec == y->st_mtim.tv_sec && x->st_mtim.tv_nsec > y->st_mtim.tv_nsec);
+}
+
+int test_files(const char *a, const char *op, const char *b) { // -nt -ot -ef, -1 for other ops
+    struct stat x, y;
+    int hx = stat(a, &x) == 0, hy = stat(b, &y) == 0;
+
+    if (!strcmp(op, "-nt"))
+        return !(hx && (!hy || newer(&x, &y)));
+    if (!strcmp(op, "-ot"))
+        return !(hy && (!hx || newer(&y, &x)));
+    if (!strcmp(op, "-ef"))
+        return !(hx && hy && x.st_dev == y.st_dev && x.st_ino == y.st_ino);
+
+    return -1;
+}
+
+int test_binary(const char *a, const char *op, const char *b) { // -1 if op is not binary
+    static const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+    long long x, y;
+    char *end;
+    int i;
+
+    if (!strcmp(op, "=") || !strcmp(op, "=="))
+        return strcmp(a, b) != 0;
+    if (!strcmp(op, "!="))
+        return strcmp(a, b) == 0;
+    if ((i = test_files(a, op, b)) != -1)
+        return i;
+
+    for (i = 0; ops[i] && strcmp(op, ops[i]); i++);
+    if (!ops[i])
+        return -1;
+    x = strtoll(a, &end, 10);
+    if (!*a || *end)
+        return 2;
+    y = strtoll(b, &end, 10);
+    if (!*b || *end)
+        return 2;
+    switch (i) {
+        case 0: return !(x == y);
+        case 1: return !(x != y);
+        case 2: return !(x < y);
+        case 3: return !(x <= y);
+        case 4: return !(x > y);
+        default: return !(x >= y);
+    }
+}
+
+int test_or(int argc, char **argv, int *pos);
+
+int test_term(int argc, char **argv, int *pos) { // ! term, ( expr ), unary, binary or a string
+    int res;
+
+    if (*pos >= argc)
+        return 2;
+    if (!strcmp(argv[*pos], "!")) {
+        ++*pos;
+        return (res = test_term(argc, argv, pos)) == 2 ? 2 : !res;
+    }
+    if (!strcmp(argv[*pos], "(") && *pos + 1 < argc) {
+        ++*pos;
+        res = test_or(argc, argv, pos);
+        if (*pos >= argc || strcmp(argv[*pos], ")"))
+            return 2;
+        ++*pos;
+        return res;
+    }
+    if (*pos + 2 < argc && (res = test_binary(argv[*pos], argv[*pos+1], argv[*pos+2])) != -1) {
+        *pos += 3;
+        return res;
+    }
+    if (*pos + 1 < argc && (res = test_unary(argv[*pos], argv[*pos+1])) != -1) {
+        *pos += 2;
+        return res;
+    }
+    return argv[(*pos)++][0] == '\0';
+}
+
+int test_and(int argc, char **argv, int *pos) { // -a binds tighter than -o
+    int res = test_term(argc, argv, pos), next;
+
+    while (res != 2 && *pos < argc && !strcmp(argv[*pos], "-a")) {
+        ++*pos;
+        if ((next = test_term(argc, argv, pos)) == 2)
+            return 2;
+        res = res || next;
+    }
+
+    return res;
+}
+
+int test_or(int argc, char **argv, int *pos) {
+    int res = test_and(argc, argv, pos), next;
+
+    while (res != 2 && *pos < argc && !strcmp(argv[*pos], "-o")) {
+        ++*pos;
+        if ((next = test_and(argc, argv, pos)) == 2)
+            return 2;
+        res = res && next;
+    }
+
+    return res;
+}
+
+int test_expr(int argc, char **argv) { // POSIX rules up to 3 arguments, then -a -o ( ) ! by precedence
+    int res, pos = 0;
+
+    switch (argc) {
+        case 0:
+            return 1;
+        case 1:
+            return argv[0][0] == '\0';
+        case 2:
+            if (!strcmp(argv[0], "!"))
+                return !test_expr(1, argv + 1);
+            return (res = test_unary(argv[0], argv[1])) == -1 ? 2 : res;
+        case 3:
+            if ((res = test_binary(argv[0], argv[1], argv[2])) != -1)
+                return res;
+            if (!strcmp(argv[1], "-a"))
+                return !(argv[0][0] && argv[2][0]);
+            if (!strcmp(argv[1], "-o"))
+                return !(argv[0][0] || argv[2][0]);
+            if (!strcmp(argv[0], "!"))
+                return (res = test_expr(2, argv + 1)) == 2 ? 2 : !res;
+            if (!strcmp(argv[0], "(") && !strcmp(argv[2], ")"))
+                return test_expr(1, argv + 1);
+            return 2;
+        case 4:
+            if (!strcmp(argv[0], "!"))
+                return (res = test_expr(3, argv + 1)) == 2 ? 2 : !res;
+            /* fall through */
+        default:
+            res = test_or(argc, argv, &pos);
+            return pos == argc ? res : 2;
+    }
+}
+
+int builtin_test(char **argv) {
+    int argc = 0, res;
+    while (argv[argc])
+        ++argc;
+
+    if (!strcmp(argv[0], "[")) {
+        if (strcmp(argv[argc-1], "]")) {
+            fflush(stdout);
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        --argc;
+    }
+    if ((res = test_expr(argc - 1, argv + 1)) == 2) {
+        fflush(stdout);
+        fprintf(stderr, "%s: bad expression\n", argv[0]);
+    }
+
+    return res;
+}
+
+int builtin_jobs(char **argv) {
+    reap_processes();
+    for (struct job *p = jobs.first; p; p = p->next_job)
+        printf("[%d] %d Running %s\n", p->id, p->pid, p->name);
+
+    return 0;
+}
+
+int wait_job(pid_t pid) { // wait for one background job, returns its status
+    int status;
+
+    if (wait_process(pid, &status, 0, NULL, NULL) == -1) {
+        delete_process(pid);
+        return 127;
+    }
+    delete_process(pid);
+
+    return status_code(status);
+}
+
+int builtin_wait(char **argv) {
+    struct job *p;
+    pid_t pid;
+    int status = 0;
+
+    fflush(stdout);
+    if (!argv[1]) {
+        while (jobs.first)
+            wait_job(jobs.first->pid);
+        return 0;
+    }
+
+    for (char **arg = argv + 1; *arg; ++arg) {
+        if (**arg == '%') { // %N - job number
+            for (p = jobs.first; p && p->id != atoi(*arg + 1); p = p->next_job);
+        } else
+            p = find_process((pid_t)atoi(*arg));
+        if (!p) {
+            fflush(stdout);
+            fprintf(stderr, "wait: %s: no such job\n", *arg);
+            status = 127;
+            continue;
+        }
+        pid = p->pid;
+        status = wait_job(pid);
+    }
+
+    return status;
+}
+
+int builtin_plancache(char **argv) {
+    if (argv[1] && !strcmp(argv[1], "-r")) {
+        while (plans.last != plans.first) // the first one is being executed now
+            drop_plan(plans.last);
+        plans.hits = plans.misses = 0;
+        return 0;
+    }
+    printf("hits: %lu misses: %lu cached: %d\n", plans.hits, plans.misses, plans.count);
+
+    return 0;
+}
+
+int builtin_globcache(char **argv) { // globcache - directory listing stats, globcache -r - forget them
+    if (argv[1] && !strcmp(argv[1], "-r")) {
+        drop_listings(0);
+        dirs.hits = dirs.scans = 0;
+        return 0;
+    }
+    printf("hits: %lu scans: %lu cached: %zu\n", dirs.hits, dirs.scans, dirs.count);
+
+    return 0;
+}
+
+int builtin_pipesize(char **argv) { // pipesize N - capacity of conveyor pipes, pipesize - show it
+    int fd[2], size;
+    char *end;
+
+    if (!argv[1]) {
+        if (pipe_size)
+            printf("%d\n", pipe_size);
+        else
+            printf("default\n");
+        return 0;
+    }
+    size = (int)strtol(argv[1], &end, 10);
+    if (*end || size < 0)
+        return error("Pipesize error: arguments are not correct.", 0);
+    if (!size) {
+        pipe_size = 0;
+        return 0;
+    }
+    if (pipe2(fd, O_CLOEXEC))
+        return error("Pipe error.", 0);
+    size = fcntl(fd[1], F_SETPIPE_SZ, size); // rounded up to pages, limited by /proc/sys/fs/pipe-max-size
+    close(fd[0]);
+    close(fd[1]);
+    if (size == -1)
+        return error("Pipesize error: size is not allowed.", 0);
+    pipe_size = size;
+
+    return 0;
+}
+
+int builtin_trace(char **argv) { // trace FILE - log commands as JSON lines, trace - stop
+    if (trace)
+        fclose(trace);
+    trace = NULL;
+    if (!argv[1])
+        return 0;
+    if (!(trace = fopen(argv[1], "ae")))
+        return error("Trace error: can't open file.", 0);
+    setvbuf(trace, NULL, _IOLBF, 0); // nothing stays buffered across fork()
+
+    return 0;
+}
+
+int copy_fd(int in, int out);
+
+struct task { // One command started by parallel
+    pid_t pid;
+    FILE *out; // output kept until previous tasks are printed (-k)
+    int status;
+    int done;
+};
+
+char **read_items(int fd, int *n, char **data_out) { // non-empty lines of fd, *data_out holds them
+    char *data = NULL, **items = NULL, *line, *end;
+    size_t len = 0, cap = 0;
+    ssize_t got;
+
+    do {
+        data = grow(data, &cap, len + INPUT_CHUNK / 16 + 1);
+        while ((got = read(fd, data + len, cap - len - 1)) == -1 && errno == EINTR);
+        if (got > 0)
+            len += got;
+    } while (got > 0);
+    data[len] = '\0';
+
+    *n = 0;
+    for (line = data; line < data + len; line = end + 1) {
+        if (!(end = strchr(line, '\n')))
+            end = data + len;
+        *end = '\0';
+        if (*line) {
+            items = (char **)realloc(items, (*n + 2) * sizeof(char *));
+            items[(*n)++] = line;
+        }
+    }
+    if (!items) {
+        free(data);
+        return NULL;
+    }
+    items[*n] = NULL;
+    *data_out = data;
+
+    return items;
+}
+
+char *substitute(const char *arg, const char *item) { // every {} -> item
+    size_t len = strlen(arg) + 1, item_len = strlen(item);
+    const char *p;
+    char *res, *q;
+
+    for (p = arg; (p = strstr(p, "{}")); p += 2)
+        len += item_len;
+    res = q = (char *)malloc(len);
+    for (p = arg; *p; ) {
+        if (p[0] == '{' && p[1] == '}') {
+            memcpy(q, item, item_len);
+            q += item_len;
+            p += 2;
+        } else
+            *(q++) = *(p++);
+    }
+    *q = '\0';
+
+    return res;
+}
+
+pid_t start_task(char **cmd, int ncmd, const char *item, struct task *task) {
+    char **args = (char **)malloc((ncmd + 2) * sizeof(char *));
+    int i, replaced = 0;
+
+    for (i = 0; i < ncmd; i++) {
+        replaced |= strstr(cmd[i], "{}") != NULL;
+        args[i] = substitute(cmd[i], item);
+    }
+    if (!replaced) // no {} - item is the last argument
+        args[i++] = strdup(item);
+    args[i] = NULL;
+
+    fflush(stdout);
+    if (task->out)
+        fcntl(fileno(task->out), F_SETFD, FD_CLOEXEC);
+    if (!(task->pid = fork())) {
+        if (task->out)
+            dup2(fileno(task->out), 1);
+        execvp(args[0], args);
+        fprintf(stderr, "parallel: %s: %s\n", args[0], strerror(errno));
+        _exit(127);
+    }
+    if (task->pid == -1)
+        error("Fork error.", 0);
+    else
+        add_process(task->pid, args[0]);
+
+    for (i = 0; args[i]; i++)
+        free(args[i]);
+    free(args);
+
+    return task->pid;
+}
+
+int builtin_parallel(char **argv) { // parallel [-j N] [-k] command [args] [::: items]
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    char **arg = argv + 1, **cmd, **items, *data = NULL;
+    int ncmd = 0, nitems, keep = 0, from_input = 0;
+    int started = 0, running = 0, printed = 0, first = 0, failed = 0, status, j;
+    struct task *tasks;
+    pid_t pid;
+
+    for (; *arg && **arg == '-'; ++arg) {
+        if (!strcmp(*arg, "-k"))
+            keep = 1;
+        else if (!strncmp(*arg, "-j", 2) && ((*arg)[2] || arg[1]))
+            slots = atol((*arg)[2] ? *arg + 2 : *(++arg));
+        else if (!strcmp(*arg, "--")) {
+            ++arg;
+            break;
+        } else
+            break;
+    }
+    cmd = arg;
+    while (cmd[ncmd] && strcmp(cmd[ncmd], ":::"))
+        ++ncmd;
+    if (!ncmd || slots < 1) {
+        fflush(stdout);
+        fprintf(stderr, "parallel: usage: parallel [-j N] [-k] command [args] [::: items]\n");
+        return 2;
+    }
+    if (cmd[ncmd]) {
+        items = cmd + ncmd + 1;
+        for (nitems = 0; items[nitems]; nitems++);
+    } else {
+        from_input = 1;
+        if (!(items = read_items(0, &nitems, &data)))
+            return 0;
+    }
+
+    tasks = (struct task *)calloc(nitems, sizeof(struct task));
+    while (started < nitems || running) {
+        if (started < nitems && running < slots) {
+            if (keep)
+                tasks[started].out = tmpfile();
+            if (start_task(cmd, ncmd, items[started], &tasks[started]) == -1) {
+                tasks[started].done = 1;
+                tasks[started].status = 126;
+            } else
+                running++;
+            started++;
+            continue;
+        }
+
+        if ((pid = wait_process(-1, &status, 0, NULL, NULL)) == -1)
+            break;
+        delete_process(pid);
+        for (j = first; j < started && tasks[j].pid != pid; j++);
+        if (j == started) // some earlier background job
+            continue;
+        tasks[j].done = 1;
+        tasks[j].status = status_code(status);
+        running--;
+        while (first < started && tasks[first].done)
+            first++;
+
+        while (printed < started && tasks[printed].done) { // -k: print in input order
+            if (tasks[printed].out) {
+                fflush(stdout);
+                lseek(fileno(tasks[printed].out), 0, SEEK_SET);
+                copy_fd(fileno(tasks[printed].out), 1);
+                fclose(tasks[printed].out);
+            }
+            printed++;
+        }
+    }
+
+    for (j = 0; j < nitems; j++) {
+        if (tasks[j].status) {
+            failed++;
+            fflush(stdout);
+            fprintf(stderr, "parallel: %s %s: exit status %d\n", cmd[0], items[j], tasks[j].status);
+        }
+    }
+    free(tasks);
+    if (from_input) {
+        free(data);
+        free(items);
+    }
+
+    return failed ? 123 : 0;
 }
 
-int check_sys_cmd(char **command) {
+struct builtin { // Command executed without exec()
+    const char *name;
+    int (*run)(char **argv);
+};
+
+struct builtin builtins[] = {
+    {"exit", builtin_exit},
+    {"cd", builtin_cd},
+    {"pwd", builtin_pwd},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"echo", builtin_echo},
+    {"printf", builtin_printf},
+    {"test", builtin_test},
+    {"[", builtin_test},
+    {"jobs", builtin_jobs},
+    {"wait", builtin_wait},
+    {"plancache", builtin_plancache},
+    {"globcache", builtin_globcache},
+    {"trace", builtin_trace},
+    {"pipesize", builtin_pipesize},
+    {"parallel", builtin_parallel},
+    {NULL, NULL}
+};
+
+struct builtin *find_builtin(char **command) {
     if (!command)
-        return 1;
-    if (!strcmp(*command, "exit"))
-        exit(0);
-    if (!strcmp(*command, "cd")) {
-        if (chdir(command[1]))
-            return error("Cd error: arguments are not correct.", 0);
-        else
-            return 0;
+        return NULL;
+    for (struct builtin *b = builtins; b->name; b++) {
+        if (!strcmp(*command, b->name))
+            return b;
     }
 
-    return 1;
+    return NULL;
 }
 
 void slash(char *str) {
     char *p = str;
-    for (int i = 0; i < MAX_STR; i++) {
+    for (int i = 0; i < MAX_STR && p[i]; i++) {
         if (p[i] == '\\') {
             if (p[i+1] == ' ') {
                 p[i+1] = '#';
@@ -168,12 +1417,12 @@ void slash(char *str) {
 
 void white(char *str) {
     char *p = str;
-    for (int i = 0; i < MAX_STR; i++) {
+    for (int i = 0; i < MAX_STR && p[i]; i++) {
         if (p[i] == '\\') {
             if (p[i+1] == '#') {
                 p = str;
                 int g = 0;
-                for (int k = 0; k < MAX_STR; k++) {
+                for (int k = 0; k < MAX_STR && p[k]; k++) {
                     if (p[k] == '\\' && p[k+1] == '#') {
                         str[g++] = ' ';
                         k++;
@@ -181,6 +1430,7 @@ void white(char *str) {
                     }
                     str[g++] = p[k];
                 }
+                str[g] = '\0';
                 return;
             }
         }
@@ -189,13 +1439,21 @@ void white(char *str) {
 
 void newl(char *str) {
     char *p = str;
-    for (int i = 0; i < MAX_STR; i++) {
+    for (int i = 0; i < MAX_STR && p[i]; i++) {
             if (p[i] == '+') {
                 p[i] = '\n';
             }
     }
 }
 
+void unescape_args(char **argv) { // call as each literal word is added: only the first argument is undone
+    if (argv[1] != NULL && argv[2] == NULL) {
+        // slash(argv[1]);
+        white(argv[1]);
+        newl(argv[1]);
+    }
+}
+
 int skipto(char *str, const char *sep) {
     for (int i = 0; i < MAX_STR; ++i) {
         if (str[i] == 0)
@@ -232,6 +1490,8 @@ void get_token() {
 
     // printf("\n---get_token()---\n");
 
+    while (buffer[cursor] == ' ' || buffer[cursor] == '\t') // "(...) && ...": blanks between operators
+        ++cursor;
     if ((buffer[cursor] == '&' && buffer[cursor+1] == '&') ||
         (buffer[cursor] == '|' && buffer[cursor+1] == '|')) {
         token[0] = buffer[cursor];
@@ -294,17 +1554,175 @@ char **get_arg(char **h, int size, char *cmd) {
     return tmp;
 }
 
+int count_args(char **argv) {
+    int n = 0;
+    while (argv[n])
+        ++n;
+
+    return n;
+}
+
+struct matches { // Paths a pattern expanded to
+    char **words;
+    int n, cap;
+};
+
+void add_match(struct matches *m, const char *path) {
+    if (m->n == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        m->words = (char **)realloc(m->words, m->cap * sizeof(char *));
+        if (m->words == NULL)
+            error("Realloc error.", 1);
+    }
+    m->words[m->n++] = strdup(path);
+}
+
+int is_pattern(const char *word, int len) { // has * ? [ and no escapes
+    int found = 0;
+    for (int i = 0; i < len; i++) {
+        if (word[i] == '\\')
+            return 0;
+        found |= word[i] == '*' || word[i] == '?' || word[i] == '[';
+    }
+
+    return found;
+}
+
+void glob_path(char *path, size_t len, const char *rest, struct matches *m) { // path[0, len) is expanded already
+    const char *slash = strchr(rest, '/');
+    size_t size = slash ? (size_t)(slash - rest) : strlen(rest);
+    char part[PATH_MAX];
+    struct stat st;
+
+    if (size >= PATH_MAX || len + size + 1 >= PATH_MAX)
+        return;
+    memcpy(part, rest, size);
+    part[size] = '\0';
+    if (!is_pattern(part, size)) { // "dir/" of "dir/*.txt"
+        memcpy(path + len, part, size + 1);
+        len += size;
+        if (slash) {
+            path[len++] = '/';
+            path[len] = '\0';
+            glob_path(path, len, slash + 1, m);
+        } else if (!lstat(path, &st)) {
+            add_match(m, path);
+        }
+        return;
+    }
+
+    path[len] = '\0';
+    struct listing *l = get_listing(len ? path : ".");
+    if (!l)
+        return;
+    l->busy++;
+    for (size_t i = 0; i < l->count; i++) {
+        struct dir_entry *e = &l->entries[i];
+        size_t n = strlen(e->name);
+        if (fnmatch(part, e->name, FNM_PERIOD) || len + n + 1 >= PATH_MAX) // dot files only for ".*"
+            continue;
+        memcpy(path + len, e->name, n + 1);
+        if (!slash) {
+            add_match(m, path);
+        } else if (e->type == DT_DIR || ((e->type == DT_UNKNOWN || e->type == DT_LNK) &&
+                                         !stat(path, &st) && S_ISDIR(st.st_mode))) {
+            path[len + n] = '/';
+            path[len + n + 1] = '\0';
+            glob_path(path, len + n + 1, slash + 1, m);
+        }
+    }
+    l->busy--;
+}
+
+void mark_pattern(struct cmd *this) { // the last word of argv, expanded by expand_args()
+    int n = count_args(this->argv);
+
+    this->patterns = (char *)realloc(this->patterns, n);
+    if (this->patterns == NULL)
+        error("Realloc error.", 1);
+    memset(this->patterns + this->patterns_n, 0, n - this->patterns_n);
+    this->patterns[n-1] = 1;
+    this->patterns_n = n;
+}
+
+char **expand_args(const struct cmd *cmdstruc) { // argv with patterns replaced by their matches in order, all copies
+    struct matches m = {NULL, 0, 0};
+    char path[PATH_MAX];
+
+    for (int i = 0; cmdstruc->argv[i]; i++) {
+        int n = m.n;
+        if (i < cmdstruc->patterns_n && cmdstruc->patterns[i]) {
+            path[0] = '\0';
+            glob_path(path, 0, cmdstruc->argv[i], &m);
+            if (m.n == n) { // no matches: the word itself, as if it were literal
+                add_match(&m, cmdstruc->argv[i]);
+                if (i == 1) {
+                    white(m.words[n]);
+                    newl(m.words[n]);
+                }
+            }
+        } else
+            add_match(&m, cmdstruc->argv[i]);
+    }
+    m.words = (char **)realloc(m.words, (m.n + 1) * sizeof(char *));
+    if (m.words == NULL)
+        error("Realloc error.", 1);
+    m.words[m.n] = NULL;
+
+    return m.words;
+}
+
+struct cmd *expand_conveyor(const struct cmd *cmdstruc) { // copies of the stages with patterns expanded, NULL if none has any
+    const struct cmd *stage;
+    struct cmd *copy;
+    size_t n = 0, i;
+    int found = 0;
+
+    for (stage = cmdstruc; stage; stage = stage->pipe, n++)
+        found |= stage->patterns_n > 0;
+    if (!found)
+        return NULL;
+    copy = (struct cmd *)malloc(n * sizeof(struct cmd));
+    if (copy == NULL)
+        error("Malloc error.", 1);
+    for (i = 0, stage = cmdstruc; stage; stage = stage->pipe, i++) {
+        copy[i] = *stage; // the rest is shared with the plan
+        if (stage->patterns_n)
+            copy[i].argv = expand_args(stage);
+        copy[i].pipe = stage->pipe ? copy + i + 1 : NULL;
+    }
+
+    return copy;
+}
+
+void free_expanded(struct cmd *copy) {
+    struct cmd *stage = copy;
+
+    while (stage) {
+        if (stage->patterns_n) {
+            for (char **p = stage->argv; *p; p++)
+                free(*p);
+            free(stage->argv);
+        }
+        stage = stage->pipe;
+    }
+    free(copy);
+}
+
 struct cmd *get_command();
 
 struct cmd *new_command() {
     struct cmd *tmp = (struct cmd *)malloc(sizeof(struct cmd));
     tmp->argv = 0;
+    tmp->patterns = 0;
+    tmp->patterns_n = 0;
     tmp->input_file = 0;
     tmp->output_file = 0;
     tmp->append = 0;
     tmp->background = 0;
     tmp->and = 0;
     tmp->or = 0;
+    tmp->timed = 0;
     tmp->subcmd = 0;
     tmp-> pipe = 0;
     tmp->next = 0;
@@ -363,6 +1781,10 @@ struct cmd *get_simple_command() {
         } else
             len = skipto(command+end, " <>|\n");
         this->argv = get_arg(this->argv, len, command+end);
+        if (!flag && is_pattern(command+end, len))
+            mark_pattern(this); // expanded just before it runs, earlier commands may change the files
+        else
+            unescape_args(this->argv);
         // print_cmd(this, "2. get_simple_command::this");
         end += len;
         if (flag) {
@@ -424,17 +1846,31 @@ struct cmd *get_simple_command() {
         len = skipon(command+end, " ");
         end += len;
     }
-
     // printf("\n---End get_simple_command()---\n");
     return this;
 }
 
+void strip_time(struct cmd *this) { // time conveyor [&& ||]: the prefix is a flag, not a command
+    if (!this->argv || strcmp(this->argv[0], "time"))
+        return;
+    free(this->argv[0]);
+    memmove(this->argv, this->argv + 1, sizeof(char *) * count_args(this->argv));
+    if (!this->argv[0]) {
+        free(this->argv);
+        this->argv = 0;
+    }
+    this->timed = 1;
+}
+
 struct cmd *get_conveyor() { // Выделяем конвейеры
     struct cmd *this;
     struct cmd *tmp;
 
     // printf("\n---Start get_conveyor()---\n");
     this = get_command();
+    strip_time(this);
+    if (!this->argv && !this->subcmd && !strcmp(token, "|\n"))
+        error("Nothing to time before '|'.", 1);
     this->pipe = 0;
     tmp = this;
     while (!strcmp(token, "|\n")) {
@@ -512,121 +1948,622 @@ struct cmd *parse() {
     return parsed;
 }
 
-int execute (struct cmd *cmdstruc, int ispipe) {
-    int status;
-    int fd[2];
+int redirect(const char *input_file, const char *output_file, int append) { // < > >> for current process
     int in, out;
-    pid_t curpid = 0;
 
-    if (cmdstruc) {
-        if (cmdstruc->argv || cmdstruc->subcmd) {
-            if (cmdstruc->pipe) {
-                if(pipe(fd)) {
-                    sleep(1);
-                    error("Pipe error.", 1);
-                }
-            }
-            if (check_sys_cmd(cmdstruc->argv)) {
-                if (!(curpid = fork())) {
-                    if (cmdstruc->pipe) {
-                        if (cmdstruc->output_file) {
-                            error("Output file error.", 0);
-                            free(cmdstruc->output_file);
-                            cmdstruc->output_file = 0; 
-                        }
-                        dup2(fd[1], 1);
-                        close(fd[0]);
-                        close(fd[1]);
-                    }
-                    if (ispipe) {
-                        if (cmdstruc->input_file) {
-                            error("Input file error.", 0);
-                            free(cmdstruc->input_file);
-                            cmdstruc->input_file = 0; 
-                        }
-                        dup2(ispipe, 0);
-                        close(ispipe);
-                    }
-                    if (cmdstruc->input_file) {
-                        if ((in = open(cmdstruc->input_file, O_RDONLY)) == -1) {
-                            free(cmdstruc->input_file);
-                            cmdstruc->input_file = 0;
-                            error("Input file error.", 0);
-                        } else {
-                            dup2(in, 0);
-                            close(in);
-                        }
-                    }
-                    if (cmdstruc->output_file) {
-                        if ((out = open(cmdstruc->output_file, O_WRONLY | O_CREAT | (cmdstruc->append ? O_APPEND : O_TRUNC), 0777)) == -1) {
-                            free(cmdstruc->output_file);
-                            cmdstruc->output_file = 0; 
-                            error("Output file error.", 0);
-                        } else {
-                            dup2(out, 1);
-                            close(out);
-                        }
-                    }
-                    if (cmdstruc->argv) {
-                        if (cmdstruc->argv[1] != NULL) {
-                            // print_cmd(cmdstruc, "1");
-                            // slash(cmdstruc->argv[1]);
-                            white(cmdstruc->argv[1]);
-                            // print_cmd(cmdstruc, "2");
-                            newl(cmdstruc->argv[1]);
-                            // print_cmd(cmdstruc, "3");
-                        }
-                        if (execvp(cmdstruc->argv[0], cmdstruc->argv))
-                            printf("%s - unknown command\n", cmdstruc->argv[0]);
-                    } else
-                        if (cmdstruc->subcmd)
-                            execute(cmdstruc->subcmd, 0);
-                    exit(0);
-                } else
-                    if (cmdstruc->background)
-                        add_process(curpid);
-            }
-            if (cmdstruc->pipe) {
-                close(fd[1]);
-                execute(cmdstruc->pipe, fd[0]);
-                close(fd[0]);
-            }
-            if (!cmdstruc->background)
-                waitpid(curpid, &status, 0);
-            while(cmdstruc->next) {
-                if (cmdstruc->and && !cmdstruc->background) {
-                    if (WIFEXITED(status)) {
-                        if (!WEXITSTATUS(status)) {
-                            cmdstruc->and = 0;
-                            continue;
-                        } else {
-                            cmdstruc=cmdstruc->next;
-                            continue;
-                        }
-                    }
-                } else
-                    if (cmdstruc->or && !cmdstruc->background) {
-                        if (WIFEXITED(status)) {
-                            if (WEXITSTATUS(status)) {
-                                cmdstruc->or = 0;
-                                continue;
-                            } else {
-                                cmdstruc = cmdstruc->next;
-                                continue;
-                            }
+    if (input_file) {
+        if ((in = open(input_file, O_RDONLY)) == -1)
+            return error("Input file error.", 0);
+        dup2(in, 0);
+        close(in);
+    }
+    if (output_file) {
+        if ((out = open(output_file, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0777)) == -1)
+            return error("Output file error.", 0);
+        dup2(out, 1);
+        close(out);
+    }
+
+    return 0;
+}
+
+int run_builtin(struct builtin *builtin, const struct cmd *cmdstruc) { // builtin in the shell process
+    int saved_in = -1, saved_out = -1;
+    int status = 1;
+
+    if (cmdstruc->output_file)
+        fflush(stdout);
+    if (cmdstruc->input_file)
+        saved_in = dup(0);
+    if (cmdstruc->output_file)
+        saved_out = dup(1);
+    if (!redirect(cmdstruc->input_file, cmdstruc->output_file, cmdstruc->append))
+        status = builtin->run(cmdstruc->argv);
+    if (saved_out != -1)
+        fflush(stdout);
+    if (saved_in != -1) {
+        dup2(saved_in, 0);
+        close(saved_in);
+    }
+    if (saved_out != -1) {
+        dup2(saved_out, 1);
+        close(saved_out);
+    }
+
+    return status;
+}
+
+const char *copy_source(const struct cmd *cmdstruc) { // file of a trivial "cat FILE" stage
+    char **argv = cmdstruc->argv;
+
+    if (!argv || strcmp(argv[0], "cat") || (cmdstruc->pipe && cmdstruc->output_file))
+        return NULL;
+    if (argv[1] && !argv[2] && argv[1][0] != '-' && !cmdstruc->input_file)
+        return argv[1];
+    if (!argv[1] && cmdstruc->input_file)
+        return cmdstruc->input_file;
+
+    return NULL;
+}
+
+int copy_fd(int in, int out) { // move all data from in to out avoiding user space
+    enum { SPLICE, COPY_RANGE, SENDFILE, READ_WRITE } mode;
+    char *buf = NULL;
+    struct stat st;
+    ssize_t n, w;
+
+    if (fstat(out, &st) == -1)
+        return -1;
+    if (S_ISFIFO(st.st_mode))
+        mode = SPLICE;
+    else if (S_ISREG(st.st_mode))
+        mode = COPY_RANGE;
+    else
+        mode = SENDFILE;
+
+    while (1) {
+        switch (mode) {
+            case SPLICE:
+                n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+                break;
+            case COPY_RANGE:
+                n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+                break;
+            case SENDFILE:
+                n = sendfile(out, in, NULL, COPY_CHUNK);
+                break;
+            case READ_WRITE:
+            default:
+                if (!buf && !(buf = (char *)malloc(COPY_BUFFER)))
+                    return -1;
+                if ((n = read(in, buf, COPY_BUFFER)) > 0) {
+                    for (ssize_t done = 0; done < n; done += w) {
+                        if ((w = write(out, buf + done, n - done)) == -1) {
+                            free(buf);
+                            return -1;
                         }
-                    } else {
-                        execute(cmdstruc->next, 0);
-                        break;
                     }
-            }
+                }
+                break;
+        }
+        if (n == 0)
+            break;
+        if (n > 0 || errno == EINTR)
+            continue;
+        if (mode != READ_WRITE && (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+                                   errno == EOPNOTSUPP || (mode == COPY_RANGE && errno == EBADF))) {
+            mode++; // this pair of descriptors is not supported, try the next way
+            continue;
+        }
+        free(buf);
+        return -1;
+    }
+    free(buf);
+
+    return 0;
+}
+
+int run_copy(const char *path, const struct cmd *cmdstruc, int out) { // "cat FILE" in the shell process
+    int in, close_out = 0, status = 0;
+    void (*old_handler)(int);
+
+    fflush(stdout);
+    if ((in = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (out == -1 && cmdstruc->output_file) {
+        if ((out = open(cmdstruc->output_file, O_WRONLY | O_CREAT | O_CLOEXEC | (cmdstruc->append ? O_APPEND : O_TRUNC), 0777)) == -1) {
+            close(in);
+            return error("Output file error.", 0);
+        }
+        close_out = 1;
+    } else if (out == -1)
+        out = 1;
+
+    old_handler = signal(SIGPIPE, SIG_IGN); // a reader may exit early
+    if (copy_fd(in, out) == -1) {
+        if (errno == EPIPE) {
+            status = 128 + SIGPIPE;
+        } else {
+            fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+            status = 1;
+        }
+    }
+    signal(SIGPIPE, old_handler);
+    close(in);
+    if (close_out)
+        close(out);
+
+    return status;
+}
+
+int execute(const struct cmd *cmdstruc);
+
+void run_stage(const struct cmd *cmdstruc, int in, int out, const int *unused, int nunused) { // in a child, never returns
+    const char *input_file = cmdstruc->input_file;
+    const char *output_file = cmdstruc->output_file;
+    struct builtin *builtin;
+    int status;
+
+    if (zygote.sock != -1) { // replies of the fork server belong to the parent shell
+        close(zygote.sock);
+        zygote.sock = -1;
+        zygote.count = 0;
+    }
+    if (out != -1) {
+        if (output_file) {
+            error("Output file error.", 0);
+            output_file = 0;
+        }
+        dup2(out, 1);
+        close(out);
+    }
+    if (in != -1) {
+        if (input_file) {
+            error("Input file error.", 0);
+            input_file = 0;
+        }
+        dup2(in, 0);
+        close(in);
+    }
+    for (int i = 0; i < nunused; i++) { // other pipe ends of the conveyor, exec would close them anyway
+        if (unused[i] > 2 && unused[i] != in && unused[i] != out)
+            close(unused[i]);
+    }
+    if (redirect(input_file, output_file, cmdstruc->append))
+        exit(1);
+    if (cmdstruc->argv) {
+        if ((builtin = find_builtin(cmdstruc->argv))) {
+            status = builtin->run(cmdstruc->argv);
+            fflush(stdout);
+            _exit(status);
+        }
+        if (execvp(cmdstruc->argv[0], cmdstruc->argv)) {
+            printf("%s - unknown command\n", cmdstruc->argv[0]);
+            exit(127);
         }
     } else
-        error("Error NULL command", 1);
+        if (cmdstruc->subcmd) {
+            exec_tail = 1;
+            exit(execute(cmdstruc->subcmd));
+        }
+    exit(0);
+}
+
+pid_t launch(const struct cmd *cmdstruc, int in, int out, const int *unused, int nunused) { // fork one conveyor stage
+    pid_t pid;
+
+    fflush(stdout); // child must not inherit buffered output
+    if ((pid = fork()) == -1)
+        error("Fork error.", 0);
+    if (!pid)
+        run_stage(cmdstruc, in, out, unused, nunused);
+
+    return pid;
+}
+
+void zygote_reply(int sock, int exited, pid_t pid, int status, const struct rusage *ru) {
+    struct launch_reply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.exited = exited;
+    reply.pid = pid;
+    reply.status = status;
+    if (ru)
+        reply.ru = *ru;
+    if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) == -1)
+        _exit(0); // the shell is gone
+}
+
+void zygote_start(int sock, char *buf, size_t len, const int *fds) { // fork and exec one request
+    struct launch_request *req = (struct launch_request *)buf;
+    char *cwd, *input_file, *output_file, **args, *p;
+    pid_t pid;
+
+    p = cwd = buf + sizeof(*req);
+    if (len < sizeof(*req) || sizeof(*req) + req->len != len || req->argc < 1 || buf[len-1]) {
+        zygote_reply(sock, 0, -1, 0, NULL);
+        return;
+    }
+    p += strlen(p) + 1;
+    input_file = *p ? p : NULL;
+    p += strlen(p) + 1;
+    output_file = *p ? p : NULL;
+    p += strlen(p) + 1;
+    args = (char **)malloc((req->argc + 1) * sizeof(char *));
+    for (int i = 0; i < req->argc; i++) {
+        args[i] = p;
+        p += strlen(p) + 1;
+    }
+    args[req->argc] = NULL;
+
+    if (!(pid = fork())) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        for (int i = 0; i < 3; i++)
+            dup2(fds[i], i);
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] > 2)
+                close(fds[i]);
+        }
+        if (chdir(cwd))
+            exit(error("Cd error: arguments are not correct.", 0));
+        if (redirect(input_file, output_file, req->append))
+            exit(1);
+        execvp(args[0], args);
+        printf("%s - unknown command\n", args[0]);
+        exit(127);
+    }
+    free(args);
+    zygote_reply(sock, 0, pid, 0, NULL);
+}
+
+void zygote_serve(int sock) { // fork server main loop
+    static char buf[ZYGOTE_MESSAGE];
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct pollfd fds[2];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct rusage ru;
+    int passed[3], status;
+    ssize_t n;
+    pid_t pid;
+
+    signal(SIGINT, SIG_IGN);
+    init_jobs();
+    fds[0].fd = sock;
+    fds[1].fd = sigchld_pipe[0];
+    fds[0].events = fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1)
+            continue;
+        if (fds[1].revents) {
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+            while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+                zygote_reply(sock, 1, pid, status, &ru);
+        }
+        if (!fds[0].revents)
+            continue;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+        if (n <= 0)
+            _exit(0); // the shell is gone
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(passed))) {
+            zygote_reply(sock, 0, -1, 0, NULL);
+            continue;
+        }
+        memcpy(passed, CMSG_DATA(cmsg), sizeof(passed));
+        zygote_start(sock, buf, n, passed);
+        for (int i = 0; i < 3; i++)
+            close(passed[i]);
+    }
+}
+
+void start_zygote() {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+        error("Fork server error: no socket.", 0);
+        return;
+    }
+    switch (fork()) {
+        case -1:
+            error("Fork server error: can't fork.", 0);
+            close(sv[0]);
+            close(sv[1]);
+            return;
+        case 0:
+            close(sv[0]);
+            zygote_serve(sv[1]);
+            _exit(0);
+        default:
+            close(sv[1]);
+            zygote.sock = sv[0];
+    }
+}
+
+int pack(char *buf, size_t *len, const char *str) { // 1 if buf is full
+    size_t n = strlen(str) + 1;
+    if (*len + n > ZYGOTE_MESSAGE)
+        return 1;
+    memcpy(buf + *len, str, n);
+    *len += n;
 
     return 0;
 }
 
+pid_t zygote_launch(const struct cmd *cmdstruc, int in, int out) { // -1 if the fork server can't start it
+    static char buf[ZYGOTE_MESSAGE];
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct launch_request *req = (struct launch_request *)buf;
+    struct launch_reply reply;
+    const char *input_file = cmdstruc->input_file;
+    const char *output_file = cmdstruc->output_file;
+    char cwd[PATH_MAX];
+    int fds[3], full = 0;
+    size_t len = sizeof(*req);
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    if (!getcwd(cwd, sizeof(cwd)))
+        return -1;
+    if (out != -1 && output_file) {
+        error("Output file error.", 0);
+        output_file = 0;
+    }
+    if (in != -1 && input_file) {
+        error("Input file error.", 0);
+        input_file = 0;
+    }
+
+    req->append = cmdstruc->append;
+    req->argc = count_args(cmdstruc->argv);
+    full |= pack(buf, &len, cwd);
+    full |= pack(buf, &len, input_file ? input_file : "");
+    full |= pack(buf, &len, output_file ? output_file : "");
+    for (int i = 0; i < req->argc; i++)
+        full |= pack(buf, &len, cmdstruc->argv[i]);
+    if (full)
+        return -1;
+    req->len = len - sizeof(*req);
+
+    fds[0] = in != -1 ? in : 0;
+    fds[1] = out != -1 ? out : 1;
+    fds[2] = 2;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout); // the command writes to the same descriptor
+    if (sendmsg(zygote.sock, &msg, MSG_NOSIGNAL) == -1)
+        return -1;
+    do {
+        if (!zygote_receive(&reply))
+            return -1;
+    } while (reply.exited);
+    if (reply.pid == -1)
+        return -1;
+
+    if (zygote.count == zygote.size) {
+        zygote.size = zygote.size ? zygote.size * 2 : 16;
+        zygote.children = (struct remote_child *)realloc(zygote.children,
+                                                         zygote.size * sizeof(struct remote_child));
+    }
+    zygote.children[zygote.count].pid = reply.pid;
+    zygote.children[zygote.count].done = 0;
+    zygote.count++;
+
+    return reply.pid;
+}
+
+int run_in_shell(const struct cmd *cmdstruc, struct builtin *builtin, const char *path, int out) { // builtin or "cat FILE"
+    struct rusage before, after;
+    struct timespec start;
+    int status, traced = trace != NULL;
+
+    if (traced) {
+        getrusage(RUSAGE_SELF, &before);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    status = builtin ? run_builtin(builtin, cmdstruc) : run_copy(path, cmdstruc, out);
+    if (traced) {
+        getrusage(RUSAGE_SELF, &after);
+        trace_command(getpid(), cmdstruc->argv[0], status, elapsed(&start),
+                      seconds(&after.ru_utime) - seconds(&before.ru_utime),
+                      seconds(&after.ru_stime) - seconds(&before.ru_stime), after.ru_maxrss,
+                      after.ru_nvcsw - before.ru_nvcsw, after.ru_nivcsw - before.ru_nivcsw);
+    }
+
+    return status;
+}
+
+int run_stages(const struct cmd *cmdstruc, int last) { // start all stages, then wait for them
+    const struct cmd *stage, *source = NULL;
+    struct builtin *builtin;
+    const char *path;
+    pid_t *pids;
+    int *fds; // pipe i is fds[2*i] -> fds[2*i+1], between stages i and i+1
+    int in, out, source_out = -1;
+    int status = 0, wstatus;
+    size_t n = 0, i, nfds;
+    struct timespec start;
+
+    if (!cmdstruc->pipe && !cmdstruc->background) {
+        if ((builtin = find_builtin(cmdstruc->argv)))
+            return run_in_shell(cmdstruc, builtin, NULL, -1);
+        if ((path = copy_source(cmdstruc)))
+            return run_in_shell(cmdstruc, NULL, path, -1);
+        if (last && exec_tail) {
+            fflush(stdout);
+            run_stage(cmdstruc, -1, -1, NULL, 0); // this process is already a fork, exec in place
+        }
+    }
+
+    for (stage = cmdstruc; stage; stage = stage->pipe)
+        n++;
+    pids = (pid_t *)malloc(n * sizeof(pid_t));
+    nfds = 2 * (n - 1); // n >= 1
+    fds = (int *)malloc((nfds + 1) * sizeof(int));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i + 1 < n; i++) { // all pipes first, close-on-exec so no command keeps a stray end
+        if (pipe2(fds + 2 * i, O_CLOEXEC)) {
+            sleep(1);
+            error("Pipe error.", 1);
+        }
+        if (pipe_size)
+            fcntl(fds[2 * i + 1], F_SETPIPE_SZ, pipe_size);
+    }
+
+    for (i = 0, stage = cmdstruc; stage; stage = stage->pipe, i++) {
+        in = i ? fds[2 * i - 2] : -1;
+        out = stage->pipe ? fds[2 * i + 1] : -1;
+        pids[i] = -1;
+        if (i == 0 && out != -1 && !stage->background && copy_source(stage)) {
+            source = stage; // the shell feeds the pipe itself once the readers are started
+            source_out = out;
+            continue;
+        }
+        if (zygote.sock != -1 && !cmdstruc->background && stage->argv && !find_builtin(stage->argv))
+            pids[i] = zygote_launch(stage, in, out);
+        if (pids[i] == -1)
+            pids[i] = launch(stage, in, out, fds, (int)nfds);
+    }
+    for (i = 0; i < nfds; i++) {
+        if (fds[i] != source_out)
+            close(fds[i]);
+    }
+    free(fds);
+
+    if (source) {
+        status = run_in_shell(source, NULL, copy_source(source), source_out);
+        close(source_out);
+    }
+    for (i = 0, stage = cmdstruc; stage; stage = stage->pipe, i++) {
+        if (pids[i] == -1)
+            continue;
+        if (cmdstruc->background) {
+            add_process(pids[i], stage->argv ? stage->argv[0] : "(subshell)");
+            continue;
+        }
+        wait_process(pids[i], &wstatus, 0, stage->argv ? stage->argv[0] : "(subshell)", &start);
+        status = status_code(wstatus); // status of a conveyor is the status of its last command
+    }
+    free(pids);
+
+    return status;
+}
+
+int run_conveyor(const struct cmd *cmdstruc, int last) { // patterns see what the commands before changed
+    struct cmd *expanded = expand_conveyor(cmdstruc);
+    int status = run_stages(expanded ? expanded : cmdstruc, last);
+
+    free_expanded(expanded);
+
+    return status;
+}
+
+const struct cmd *time_list(const struct cmd *cmdstruc, int *status);
+
+const struct cmd *run_and_or(const struct cmd *cmdstruc, int *status, int timing) { // conveyors joined by && ||, returns the one after them
+    const struct cmd *timed = timing ? cmdstruc : NULL; // its prefix is being handled by time_list()
+    int skip = 0;
+
+    while (1) {
+        if (!skip) {
+            if (cmdstruc->timed && cmdstruc != timed)
+                return time_list(cmdstruc, status); // times the rest of this and-or list
+            if (cmdstruc->argv || cmdstruc->subcmd)
+                *status = run_conveyor(cmdstruc, !cmdstruc->next && !timing); // no exec, the report comes after it
+            else
+                *status = 0; // bare "time"
+        }
+        if (!cmdstruc->next || cmdstruc->background || !(cmdstruc->and || cmdstruc->or))
+            return cmdstruc->next;
+        skip = (cmdstruc->and && *status) || (cmdstruc->or && !*status); // skip conveyor after && or ||
+        cmdstruc = cmdstruc->next;
+    }
+}
+
+int run_list(const struct cmd *cmdstruc) { // conveyors separated by ; & && ||
+    int status = 0;
+
+    if (!cmdstruc)
+        error("Error NULL command", 1);
+    while (cmdstruc)
+        cmdstruc = run_and_or(cmdstruc, &status, 0);
+
+    return status;
+}
+
+void print_time(const char *label, double sec) { // bash-like "0m0.000s"
+    int min = (int)(sec / 60);
+    fprintf(stderr, "%s\t%dm%.3fs\n", label, min, sec - min * 60);
+}
+
+const struct cmd *time_list(const struct cmd *cmdstruc, int *status) { // time conveyor [&& ||]: report its resources
+    struct usage before = usage;
+    struct rusage self, self_after;
+    struct timespec start;
+    const struct cmd *next;
+    double real;
+
+    getrusage(RUSAGE_SELF, &self);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    usage.maxrss = 0;
+    next = run_and_or(cmdstruc, status, 1);
+    real = elapsed(&start);
+    getrusage(RUSAGE_SELF, &self_after);
+
+    fflush(stdout);
+    fprintf(stderr, "\n");
+    print_time("real", real);
+    print_time("user", usage.user - before.user +
+               seconds(&self_after.ru_utime) - seconds(&self.ru_utime));
+    print_time("sys", usage.sys - before.sys +
+               seconds(&self_after.ru_stime) - seconds(&self.ru_stime));
+    fprintf(stderr, "maxrss\t%ld KB\n", usage.maxrss);
+    fprintf(stderr, "csw\t%ld voluntary, %ld involuntary\n",
+            usage.nvcsw - before.nvcsw + self_after.ru_nvcsw - self.ru_nvcsw,
+            usage.nivcsw - before.nivcsw + self_after.ru_nivcsw - self.ru_nivcsw);
+    if (before.maxrss > usage.maxrss)
+        usage.maxrss = before.maxrss;
+
+    return next;
+}
+
+int execute(const struct cmd *cmdstruc) {
+    return run_list(cmdstruc);
+}
+
 void free_memory(struct cmd *cmdstruc) {
     char **tmp;
 
@@ -639,6 +2576,7 @@ void free_memory(struct cmd *cmdstruc) {
                 free(*(tmp++));
         }
         free(cmdstruc->argv);
+        free(cmdstruc->patterns);
         free_memory(cmdstruc->next);
         free_memory(cmdstruc->pipe);
         free_memory(cmdstruc->subcmd);
@@ -647,17 +2585,33 @@ void free_memory(struct cmd *cmdstruc) {
 }
 
 
+int next_char() { // getchar() for the terminal, large read() chunks for scripts
+    if (interactive)
+        return getchar();
+    if (input.pos == input.len) {
+        while ((input.len = read(input.fd, input.buf, INPUT_CHUNK)) == -1 && errno == EINTR);
+        input.pos = 0;
+        if (input.len <= 0) {
+            input.len = 0;
+            return EOF;
+        }
+    }
+
+    return (unsigned char)input.buf[input.pos++];
+}
+
 char *readl() {
     char c, *buff = NULL;
     int i = 0, quote1 = 0, quote2 = 0;
-    while ((c = getchar()) != EOF) {
+    size_t cap = 0;
+    while ((c = next_char()) != EOF) {
         if (c == '\\') {
             if (buff[i-1] == '\\') {
                 continue;
             } else {
-                c = getchar();
+                c = next_char();
                 if (c == '"') {
-                    buff = (char *)realloc(buff, ++i * sizeof(char));
+                    buff = grow(buff, &cap, ++i);
                     buff[i-1] = c;
                     continue;
                 }
@@ -669,12 +2623,12 @@ char *readl() {
                     quote1 = (quote1+1) % 2;
                 }
             if (c == ' ') {
-                buff = (char *)realloc(buff, ++i * sizeof(char));
+                buff = grow(buff, &cap, ++i);
                 buff[i-1] = c;
                 continue;
             }
         }
-        if (c == '#' && !quote1 && !quote2) while ((c = getchar()) != '\n');
+        if (c == '#' && !quote1 && !quote2) while ((c = next_char()) != '\n' && c != EOF);
         if (c == '\"' && quote2 % 2 == 0) {
             if (buffer[i-1] != '\\' || !quote1) {
                 quote1 = (quote1+1) % 2;
@@ -693,20 +2647,21 @@ char *readl() {
                 continue;
             }
             i += 2;
-            buff = (char *)realloc(buff, i * sizeof(char));
+            buff = grow(buff, &cap, i);
             buff[i-2] = '\n';
             buff[i-1] = '\0';
             return buff;
         }
         if (c == '\n' && quote1) {
-            buff = (char *)realloc(buff, ++i * sizeof(char));
+            buff = grow(buff, &cap, ++i);
             buff[i-1] = '+';
             continue;
         }
-        buff = (char *)realloc(buff, ++i * sizeof(char));
+        buff = grow(buff, &cap, ++i);
         buff[i-1] = c;
     }
 
+    free(buff);
     return NULL;
 
 }
@@ -749,27 +2704,70 @@ char *readit() {
 
 
 
-int main(int argc, char **argv) {
+void init_input(int argc, char **argv) { // task_2 [script]
+    input.fd = 0;
+    if (argc > 1) {
+        if ((input.fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "Can't open script %s.\n", argv[1]);
+            exit(127);
+        }
+        interactive = 0;
+    } else
+        interactive = isatty(0);
+
+    if (!interactive) {
+        input.buf = (char *)malloc(INPUT_CHUNK);
+        if (input.buf == NULL) {
+            fprintf(stderr, "Malloc error.\n");
+            exit(EXIT_FAILURE);
+        }
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER);
+    } else
+        signal(SIGINT, SIG_IGN);
+}
+
+int main(int argc, char **argv) { // task_2 [-z] [script]
+    const struct cmd *plan;
+    char *str;
+    size_t len;
+
     // readit();
+    if (argc > 1 && !strcmp(argv[1], "-z")) { // launch commands through the fork server
+        start_zygote();
+        argc--;
+        argv++;
+    }
+    init_input(argc, argv);
+    init_jobs();
     while (1) {
-        do {
-            setjmp(point);
-            signal(SIGINT, SIG_IGN);
-            token[0] = 0;
-            cursor = 0;
-            print_list();
-            // printf("%s", INVITE);
-            char *str = readl();
-            printf("Str: [%s]", str);
-            // char *str = readit();
-            if (!str)
-                exit(0);
-            memcpy(buffer, str, strlen(str));
-            // strncpy(buffer, str, strlen(str));
+        setjmp(point);
+        token[0] = 0;
+        cursor = 0;
+        reap_processes();
+        // printf("%s", INVITE);
+        str = readl();
+        // printf("Str: [%s]", str);
+        // char *str = readit();
+        if (!str)
+            exit(0);
+        if ((len = strlen(str)) >= MAX_COMMAND_LENGTH) {
+            free(str);
+            error("Command is too long.", 1);
+        }
+        memcpy(buffer, str, len + 1);
+        free(str);
+        // strncpy(buffer, str, strlen(str));
+        if (!(plan = find_plan(buffer))) {
             get_token();
-        } while (!(head = parse()));
-        execute(head, 0);
+            plan = head = parse();
+            if (token[0] == '\n') { // only lines without syntax errors are cached
+                add_plan(buffer, head);
+                head = NULL;
+            }
+        }
+        execute(plan);
         free_memory(head);
+        head = NULL;
     }
 
     return 0;